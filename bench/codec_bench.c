@@ -0,0 +1,110 @@
+// Compares the JSON and binary ESP codecs: bytes on the wire per message and
+// CPU time spent encoding requests and decoding responses.
+#include "esp.h"
+#include "codec.h"
+#include <stdio.h>
+#include <time.h>
+#include <libubox/blobmsg_json.h>
+
+#define BENCH_ITERATIONS 200000
+#define BENCH_BUFFER_SIZE 1024
+// 8N1 framing puts ten bits on the wire for every byte.
+#define BENCH_BAUDRATE 9600
+#define BENCH_BITS_PER_BYTE 10
+
+static const char *bench_response_json =
+    "{\"rc\": 0, \"msg\": \"Sensor read.\", \"data\": {\"temperature\": 23.5, \"humidity\": 41.0}}";
+
+static double
+monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static double
+wire_time_ms(int bytes) {
+    return bytes * BENCH_BITS_PER_BYTE * 1000.0 / BENCH_BAUDRATE;
+}
+
+static void
+bench_encode(enum EspCodec codec, const char *label, const struct EspAction *action) {
+    char buf[BENCH_BUFFER_SIZE];
+    int len = 0;
+
+    double start = monotonic_ns();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        len = esp_codec_encode_action(codec, action, buf, sizeof(buf));
+    }
+    double elapsed = monotonic_ns() - start;
+
+    printf(
+        "%-8s encode %-4s %5d bytes %8.2f ms wire %10.1f ns/op\n",
+        EspCodec_str[codec],
+        label,
+        len,
+        wire_time_ms(len),
+        elapsed / BENCH_ITERATIONS
+    );
+}
+
+static void
+bench_decode(enum EspCodec codec, struct blob_attr *response) {
+    char buf[BENCH_BUFFER_SIZE];
+    int len = esp_codec_encode_response(codec, response, buf, sizeof(buf));
+    if (len < 0) {
+        fprintf(stderr, "Failed to encode %s response.\n", EspCodec_str[codec]);
+        return;
+    }
+
+    struct blob_buf blob_buf = {};
+    double start = monotonic_ns();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        blob_buf_init(&blob_buf, 0);
+        if (!esp_codec_decode_response(codec, buf, len, &blob_buf)) {
+            fprintf(stderr, "Failed to decode %s response.\n", EspCodec_str[codec]);
+            break;
+        }
+    }
+    double elapsed = monotonic_ns() - start;
+    blob_buf_free(&blob_buf);
+
+    printf(
+        "%-8s decode %-4s %5d bytes %8.2f ms wire %10.1f ns/op\n",
+        EspCodec_str[codec],
+        "get",
+        len,
+        wire_time_ms(len),
+        elapsed / BENCH_ITERATIONS
+    );
+}
+
+int main(void) {
+    struct EspAction toggle_action = {
+        .action_type = ESP_ACTION_ON,
+        .pin = 5,
+    };
+    struct EspAction sensor_action = {
+        .action_type = ESP_ACTION_GET_SENSOR,
+        .pin = 4,
+        .sensor = "dht",
+        .model = "dht11",
+    };
+
+    struct blob_buf response = {};
+    blob_buf_init(&response, 0);
+    if (!blobmsg_add_json_from_string(&response, bench_response_json)) {
+        fprintf(stderr, "Failed to parse sample response.\n");
+        return 1;
+    }
+
+    enum EspCodec codecs[] = {ESP_CODEC_JSON, ESP_CODEC_BINARY};
+    for (size_t i = 0; i < ARRAY_SIZE(codecs); i++) {
+        bench_encode(codecs[i], "on", &toggle_action);
+        bench_encode(codecs[i], "get", &sensor_action);
+        bench_decode(codecs[i], response.head);
+    }
+    blob_buf_free(&response);
+
+    return 0;
+}
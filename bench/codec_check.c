@@ -0,0 +1,219 @@
+// Round trips of the JSON and binary ESP codecs, including frames the daemon has
+// to reject. Exits with the number of failed checks.
+#include "esp.h"
+#include "codec.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <libubox/blobmsg_json.h>
+
+#define CHECK_BUFFER_SIZE 1024
+// Binary frames carry data fields as single precision floats.
+#define CHECK_FLOAT_TOLERANCE 1e-4
+
+static const char *check_response_json =
+    "{\"rc\": 3, \"msg\": \"Sensor read.\", \"data\": {\"temperature\": 23.5, \"humidity\": 41, \"pressure\": 1013.25}}";
+
+static const struct blobmsg_policy check_pin_policy = {.name = "pin", .type = BLOBMSG_TYPE_UNSPEC};
+
+static int g_failures;
+
+static void
+check(bool condition, enum EspCodec codec, const char *what) {
+    printf("%-4s %-8s %s\n", condition ? "ok" : "FAIL", EspCodec_str[codec], what);
+    if (!condition) {
+        g_failures++;
+    }
+}
+
+static bool
+get_number(struct blob_attr *attr, double *value) {
+    switch (blobmsg_type(attr)) {
+        case BLOBMSG_TYPE_DOUBLE:
+            *value = blobmsg_get_double(attr);
+            return true;
+        case BLOBMSG_TYPE_INT32:
+            *value = (int32_t) blobmsg_get_u32(attr);
+            return true;
+        case BLOBMSG_TYPE_INT64:
+            *value = (int64_t) blobmsg_get_u64(attr);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Every data field of expected has to come back with the same value.
+static bool
+data_matches(struct blob_attr *expected, struct blob_attr *decoded) {
+    if (expected == NULL || decoded == NULL) {
+        return expected == decoded;
+    }
+
+    int expected_count = 0;
+    struct blob_attr *field;
+    int rem;
+    blobmsg_for_each_attr(field, expected, rem) {
+        expected_count++;
+        double expected_value, decoded_value;
+        if (!get_number(field, &expected_value)) {
+            return false;
+        }
+
+        bool found = false;
+        struct blob_attr *decoded_field;
+        int decoded_rem;
+        blobmsg_for_each_attr(decoded_field, decoded, decoded_rem) {
+            if (strcmp(blobmsg_name(field), blobmsg_name(decoded_field)) == 0) {
+                found = get_number(decoded_field, &decoded_value)
+                    && fabs(expected_value - decoded_value) <= CHECK_FLOAT_TOLERANCE * fabs(expected_value);
+                break;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    }
+
+    int decoded_count = 0;
+    blobmsg_for_each_attr(field, decoded, rem) {
+        decoded_count++;
+    }
+
+    return decoded_count == expected_count;
+}
+
+static bool
+response_matches(struct blob_attr *expected, struct blob_attr *decoded) {
+    struct blob_attr *expected_tb[__ESP_RESPONSE_MAX], *decoded_tb[__ESP_RESPONSE_MAX];
+    blobmsg_parse(esp_response_policy, __ESP_RESPONSE_MAX, expected_tb, blob_data(expected), blob_len(expected));
+    blobmsg_parse(esp_response_policy, __ESP_RESPONSE_MAX, decoded_tb, blob_data(decoded), blob_len(decoded));
+
+    return decoded_tb[ESP_RESPONSE_RC] != NULL
+        && blobmsg_get_u32(decoded_tb[ESP_RESPONSE_RC]) == blobmsg_get_u32(expected_tb[ESP_RESPONSE_RC])
+        && decoded_tb[ESP_RESPONSE_MSG] != NULL
+        && strcmp(blobmsg_get_string(decoded_tb[ESP_RESPONSE_MSG]), blobmsg_get_string(expected_tb[ESP_RESPONSE_MSG])) == 0
+        && data_matches(expected_tb[ESP_RESPONSE_DATA], decoded_tb[ESP_RESPONSE_DATA]);
+}
+
+static bool
+decode(enum EspCodec codec, const char *buf, int len, struct blob_buf *blob_buf) {
+    blob_buf_init(blob_buf, 0);
+    return esp_codec_decode_response(codec, buf, len, blob_buf);
+}
+
+static void
+check_response_round_trip(enum EspCodec codec, struct blob_attr *response) {
+    char buf[CHECK_BUFFER_SIZE];
+    int len = esp_codec_encode_response(codec, response, buf, sizeof(buf));
+    check(len > 0, codec, "encode response");
+    if (len <= 0) {
+        return;
+    }
+
+    struct blob_buf blob_buf = {};
+    bool decoded = decode(codec, buf, len, &blob_buf);
+    check(decoded && response_matches(response, blob_buf.head), codec, "decoded response matches encoded one");
+    blob_buf_free(&blob_buf);
+}
+
+static void
+check_json_action(const struct EspAction *action, const char *what) {
+    char buf[CHECK_BUFFER_SIZE];
+    int len = esp_codec_encode_action(ESP_CODEC_JSON, action, buf, sizeof(buf));
+
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    bool parsed = len > 0 && blobmsg_add_json_from_string(&blob_buf, buf);
+    struct blob_attr *pin_attr = NULL;
+    blobmsg_parse(&check_pin_policy, 1, &pin_attr, blob_data(blob_buf.head), blob_len(blob_buf.head));
+    double pin;
+    bool pin_matches = pin_attr != NULL && get_number(pin_attr, &pin) && pin == action->pin;
+    check(parsed && pin_matches, ESP_CODEC_JSON, what);
+    blob_buf_free(&blob_buf);
+}
+
+static void
+check_binary_frames(struct blob_attr *response) {
+    enum EspCodec codec = ESP_CODEC_BINARY;
+    char buf[CHECK_BUFFER_SIZE];
+    struct blob_buf blob_buf = {};
+
+    struct EspAction action = {
+        .action_type = ESP_ACTION_GET_SENSOR,
+        .pin = 255,
+        .sensor = "dht",
+        .model = "dht22",
+    };
+    int len = esp_codec_encode_action(codec, &action, buf, sizeof(buf));
+    check(
+        len > 0 && esp_codec_is_frame(buf, len) && esp_codec_frame_length(buf, len) == len,
+        codec,
+        "action frame length matches header"
+    );
+    check(esp_codec_frame_length(buf, 2) == 0, codec, "no frame length before the header is in");
+
+    action.pin = 256;
+    check(esp_codec_encode_action(codec, &action, buf, sizeof(buf)) == -1, codec, "pin 256 is rejected");
+    action.pin = -1;
+    check(esp_codec_encode_action(codec, &action, buf, sizeof(buf)) == -1, codec, "pin -1 is rejected");
+    action.pin = 4;
+    check(esp_codec_encode_action(codec, &action, buf, 8) == -1, codec, "action too long for the buffer");
+
+    len = esp_codec_encode_response(codec, response, buf, sizeof(buf));
+    if (len <= 0) {
+        check(false, codec, "encode response");
+        return;
+    }
+
+    check(!decode(codec, buf, len - 1, &blob_buf), codec, "truncated frame is rejected");
+    check(!decode(codec, buf, 4, &blob_buf), codec, "frame cut inside the header is rejected");
+
+    buf[len - 1] ^= 0x01;
+    check(!decode(codec, buf, len, &blob_buf), codec, "corrupt CRC is rejected");
+    buf[len - 1] ^= 0x01;
+
+    buf[len / 2] ^= 0x40;
+    check(!decode(codec, buf, len, &blob_buf), codec, "corrupt payload is rejected");
+    buf[len / 2] ^= 0x40;
+
+    buf[0] = '{';
+    check(!decode(codec, buf, len, &blob_buf), codec, "missing magic is rejected");
+
+    blob_buf_free(&blob_buf);
+}
+
+int main(void) {
+    struct blob_buf response = {};
+    blob_buf_init(&response, 0);
+    if (!blobmsg_add_json_from_string(&response, check_response_json)) {
+        fprintf(stderr, "Failed to parse sample response.\n");
+        return 1;
+    }
+
+    struct EspAction toggle_action = {
+        .action_type = ESP_ACTION_OFF,
+        .pin = 300,
+    };
+    struct EspAction sensor_action = {
+        .action_type = ESP_ACTION_GET_SENSOR,
+        .pin = 4,
+        .sensor = "dht",
+        .model = "dht11",
+    };
+    check_json_action(&toggle_action, "toggle action parses back, pin above 255 included");
+    check_json_action(&sensor_action, "sensor action parses back");
+
+    enum EspCodec codecs[] = {ESP_CODEC_JSON, ESP_CODEC_BINARY};
+    for (size_t i = 0; i < ARRAY_SIZE(codecs); i++) {
+        check_response_round_trip(codecs[i], response.head);
+    }
+    check_binary_frames(response.head);
+    blob_buf_free(&response);
+
+    if (g_failures > 0) {
+        printf("%d checks failed.\n", g_failures);
+    }
+
+    return g_failures;
+}
@@ -0,0 +1,83 @@
+#include "breaker.h"
+#include <syslog.h>
+
+// Consecutive read/write failures after which requests start failing fast.
+#define CIRCUIT_BREAKER_FAILURE_THRESHOLD 3
+#define CIRCUIT_BREAKER_PROBE_INTERVAL_MS 5000
+
+static void
+trip(struct CircuitBreaker *breaker) {
+    if (breaker->state == CIRCUIT_BREAKER_CLOSED) {
+        syslog(LOG_WARNING, "Circuit breaker for %s opened.", breaker->name);
+    }
+    breaker->state = CIRCUIT_BREAKER_OPEN;
+    uloop_timeout_set(&breaker->probe_timeout, CIRCUIT_BREAKER_PROBE_INTERVAL_MS);
+}
+
+static void
+probe_timeout_cb(struct uloop_timeout *timeout) {
+    struct CircuitBreaker *breaker = container_of(timeout, struct CircuitBreaker, probe_timeout);
+
+    // Only the probe gets through while half-open, so its result alone
+    // decides the next state.
+    breaker->state = CIRCUIT_BREAKER_HALF_OPEN;
+    breaker->probe(breaker);
+}
+
+void
+CircuitBreaker_init(
+    struct CircuitBreaker *breaker,
+    const char *name,
+    circuit_breaker_probe_t probe)
+{
+    breaker->state = CIRCUIT_BREAKER_CLOSED;
+    breaker->consecutive_failures = 0;
+    breaker->name = name;
+    breaker->probe = probe;
+    breaker->probe_timeout = (struct uloop_timeout) {.cb = probe_timeout_cb};
+}
+
+void
+CircuitBreaker_free(struct CircuitBreaker *breaker) {
+    uloop_timeout_cancel(&breaker->probe_timeout);
+}
+
+bool
+circuit_breaker_allows_request(const struct CircuitBreaker *breaker) {
+    return breaker->state == CIRCUIT_BREAKER_CLOSED;
+}
+
+void
+circuit_breaker_record_result(struct CircuitBreaker *breaker, enum UsbResult usb_result) {
+    switch (usb_result) {
+        case USB_RESULT_OK:
+            if (breaker->state != CIRCUIT_BREAKER_CLOSED) {
+                syslog(LOG_INFO, "Circuit breaker for %s closed.", breaker->name);
+            }
+            breaker->state = CIRCUIT_BREAKER_CLOSED;
+            breaker->consecutive_failures = 0;
+            uloop_timeout_cancel(&breaker->probe_timeout);
+            break;
+        case USB_RESULT_ERR_PORT_READ:
+        case USB_RESULT_ERR_PORT_WRITE:
+            breaker->consecutive_failures++;
+            if (breaker->state == CIRCUIT_BREAKER_HALF_OPEN
+                || breaker->consecutive_failures >= CIRCUIT_BREAKER_FAILURE_THRESHOLD) {
+                trip(breaker);
+            }
+            break;
+        default:
+            // Other failures say nothing about the ESP itself, unless the probe
+            // could not even reach it.
+            if (breaker->state == CIRCUIT_BREAKER_HALF_OPEN) {
+                trip(breaker);
+            }
+            break;
+    }
+}
+
+const char *CircuitBreakerState_str[] = {
+    "closed",
+    "open",
+    "half-open",
+};
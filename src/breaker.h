@@ -0,0 +1,45 @@
+#pragma once
+#include "serial.h"
+#include <stdbool.h>
+#include <libubox/uloop.h>
+
+enum CircuitBreakerState {
+    CIRCUIT_BREAKER_CLOSED,
+    CIRCUIT_BREAKER_OPEN,
+    CIRCUIT_BREAKER_HALF_OPEN,
+};
+
+extern const char *CircuitBreakerState_str[];
+
+struct CircuitBreaker;
+
+// Called from the probe timer while the breaker is open. The probe has to report
+// its result through circuit_breaker_record_result, which decides whether the
+// breaker closes again.
+typedef void (*circuit_breaker_probe_t)(struct CircuitBreaker *breaker);
+
+struct CircuitBreaker {
+    enum CircuitBreakerState state;
+    int consecutive_failures;
+    const char *name;
+
+    circuit_breaker_probe_t probe;
+    struct uloop_timeout probe_timeout;
+};
+
+void
+CircuitBreaker_init(
+    struct CircuitBreaker *breaker,
+    const char *name,
+    circuit_breaker_probe_t probe
+);
+
+void
+CircuitBreaker_free(struct CircuitBreaker *breaker);
+
+// Only the probe gets through while half-open.
+bool
+circuit_breaker_allows_request(const struct CircuitBreaker *breaker);
+
+void
+circuit_breaker_record_result(struct CircuitBreaker *breaker, enum UsbResult usb_result);
@@ -0,0 +1,16 @@
+#pragma once
+#include <time.h>
+
+static inline long
+monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static inline unsigned long long
+monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -0,0 +1,445 @@
+#include "codec.h"
+#include "esp.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libubox/blobmsg_json.h>
+
+#define ESP_TOGGLE_PIN_FORMAT "{\"action\": \"%s\", \"pin\": %i}"
+#define ESP_GET_SENSOR_FORMAT "{\"action\": \"get\", \"sensor\": \"%s\", \"pin\": %i, \"model\": \"%s\"}"
+
+// Binary frame layout:
+//   magic (1) | payload length, little endian (2) | TLV payload | CRC-16/CCITT (2)
+// The CRC covers the length and the payload. Every TLV is a one byte tag, a one
+// byte value length and the value.
+#define ESP_FRAME_MAGIC 0xE5
+#define ESP_FRAME_HEADER_SIZE 3
+#define ESP_FRAME_TRAILER_SIZE 2
+#define ESP_TLV_HEADER_SIZE 2
+#define ESP_TLV_MAX_VALUE_SIZE 255
+
+enum EspTlvTag {
+    ESP_TLV_ACTION = 0x01,
+    ESP_TLV_PIN = 0x02,
+    ESP_TLV_SENSOR = 0x03,
+    ESP_TLV_MODEL = 0x04,
+
+    ESP_TLV_RC = 0x10,
+    ESP_TLV_MSG = 0x11,
+    // Field name, NUL, little endian IEEE 754 single precision value.
+    ESP_TLV_DATA_FIELD = 0x12,
+};
+
+// Values of ESP_TLV_ACTION, part of the protocol and independent of EspActionType.
+enum EspWireAction {
+    ESP_WIRE_ACTION_ON = 0x00,
+    ESP_WIRE_ACTION_OFF = 0x01,
+    ESP_WIRE_ACTION_GET_SENSOR = 0x02,
+};
+
+const struct blobmsg_policy
+esp_response_policy[] = {
+    [ESP_RESPONSE_RC] = {.name = "rc", .type = BLOBMSG_TYPE_INT32},
+    [ESP_RESPONSE_MSG] = {.name = "msg", .type = BLOBMSG_TYPE_STRING},
+    [ESP_RESPONSE_DATA] = {.name = "data", .type = BLOBMSG_TYPE_TABLE},
+};
+
+struct TlvWriter {
+    uint8_t *buf;
+    int size;
+    int pos;
+    bool overflow;
+};
+
+static uint16_t
+crc16_ccitt(const uint8_t *data, int len) {
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < len; i++) {
+        crc ^= (uint16_t) data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static void
+tlv_put(struct TlvWriter *writer, uint8_t tag, const void *value, int len) {
+    if (len > ESP_TLV_MAX_VALUE_SIZE
+        || writer->pos + ESP_TLV_HEADER_SIZE + len + ESP_FRAME_TRAILER_SIZE > writer->size) {
+        writer->overflow = true;
+        return;
+    }
+    writer->buf[writer->pos++] = tag;
+    writer->buf[writer->pos++] = (uint8_t) len;
+    memcpy(writer->buf + writer->pos, value, len);
+    writer->pos += len;
+}
+
+static void
+tlv_put_u8(struct TlvWriter *writer, uint8_t tag, uint8_t value) {
+    tlv_put(writer, tag, &value, sizeof(value));
+}
+
+static void
+tlv_put_string(struct TlvWriter *writer, uint8_t tag, const char *value) {
+    tlv_put(writer, tag, value, strlen(value));
+}
+
+static struct TlvWriter
+frame_begin(char *buf, int buf_size) {
+    struct TlvWriter writer = {
+        .buf = (uint8_t *) buf,
+        .size = buf_size,
+        .pos = ESP_FRAME_HEADER_SIZE,
+        .overflow = buf_size < ESP_FRAME_HEADER_SIZE + ESP_FRAME_TRAILER_SIZE,
+    };
+    return writer;
+}
+
+static int
+frame_end(struct TlvWriter *writer) {
+    if (writer->overflow) {
+        return -1;
+    }
+
+    int payload_len = writer->pos - ESP_FRAME_HEADER_SIZE;
+    writer->buf[0] = ESP_FRAME_MAGIC;
+    writer->buf[1] = payload_len & 0xFF;
+    writer->buf[2] = (payload_len >> 8) & 0xFF;
+
+    uint16_t crc = crc16_ccitt(writer->buf + 1, writer->pos - 1);
+    writer->buf[writer->pos++] = crc & 0xFF;
+    writer->buf[writer->pos++] = (crc >> 8) & 0xFF;
+
+    return writer->pos;
+}
+
+static int
+encode_action_json(const struct EspAction *action, char *buf, int buf_size) {
+    int len = -1;
+    switch (action->action_type) {
+        case ESP_ACTION_ON:
+            len = snprintf(buf, buf_size, ESP_TOGGLE_PIN_FORMAT, "on", action->pin);
+            break;
+        case ESP_ACTION_OFF:
+            len = snprintf(buf, buf_size, ESP_TOGGLE_PIN_FORMAT, "off", action->pin);
+            break;
+        case ESP_ACTION_GET_SENSOR:
+            len = snprintf(
+                buf,
+                buf_size,
+                ESP_GET_SENSOR_FORMAT,
+                action->sensor,
+                action->pin,
+                action->model
+            );
+            break;
+    }
+    if (len < 0 || len >= buf_size) {
+        return -1;
+    }
+
+    return len;
+}
+
+static int
+encode_action_binary(const struct EspAction *action, char *buf, int buf_size) {
+    // The pin is a single byte on the wire, anything else would drive another pin.
+    if (action->pin < 0 || action->pin > UINT8_MAX) {
+        return -1;
+    }
+
+    uint8_t wire_action;
+    switch (action->action_type) {
+        case ESP_ACTION_ON:
+            wire_action = ESP_WIRE_ACTION_ON;
+            break;
+        case ESP_ACTION_OFF:
+            wire_action = ESP_WIRE_ACTION_OFF;
+            break;
+        case ESP_ACTION_GET_SENSOR:
+            wire_action = ESP_WIRE_ACTION_GET_SENSOR;
+            break;
+        default:
+            return -1;
+    }
+
+    struct TlvWriter writer = frame_begin(buf, buf_size);
+    tlv_put_u8(&writer, ESP_TLV_ACTION, wire_action);
+    tlv_put_u8(&writer, ESP_TLV_PIN, (uint8_t) action->pin);
+    if (action->action_type == ESP_ACTION_GET_SENSOR) {
+        tlv_put_string(&writer, ESP_TLV_SENSOR, action->sensor);
+        tlv_put_string(&writer, ESP_TLV_MODEL, action->model);
+    }
+
+    return frame_end(&writer);
+}
+
+int
+esp_codec_encode_action(
+    enum EspCodec codec,
+    const struct EspAction *action,
+    char *buf,
+    int buf_size)
+{
+    switch (codec) {
+        case ESP_CODEC_JSON:
+            return encode_action_json(action, buf, buf_size);
+        case ESP_CODEC_BINARY:
+            return encode_action_binary(action, buf, buf_size);
+    }
+
+    return -1;
+}
+
+// Only the bench and the codec check play the ESP, the daemon never sends responses.
+#ifdef ESP_CODEC_ENCODE_RESPONSE
+static void
+tlv_put_data_field(struct TlvWriter *writer, const char *name, float value) {
+    uint8_t field[ESP_TLV_MAX_VALUE_SIZE];
+    int name_len = strlen(name);
+    if (name_len + 1 + 4 > ESP_TLV_MAX_VALUE_SIZE) {
+        writer->overflow = true;
+        return;
+    }
+
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    memcpy(field, name, name_len + 1);
+    for (int i = 0; i < 4; i++) {
+        field[name_len + 1 + i] = (bits >> (8 * i)) & 0xFF;
+    }
+    tlv_put(writer, ESP_TLV_DATA_FIELD, field, name_len + 1 + 4);
+}
+
+static int
+encode_response_json(struct blob_attr *response, char *buf, int buf_size) {
+    char *json = blobmsg_format_json(response, true);
+    if (json == NULL) {
+        return -1;
+    }
+
+    int len = strlen(json);
+    if (len >= buf_size) {
+        free(json);
+        return -1;
+    }
+    memcpy(buf, json, len + 1);
+    free(json);
+
+    return len;
+}
+
+static int
+encode_response_binary(struct blob_attr *response, char *buf, int buf_size) {
+    struct blob_attr *tb[__ESP_RESPONSE_MAX];
+    blobmsg_parse(
+        esp_response_policy,
+        __ESP_RESPONSE_MAX,
+        tb,
+        blob_data(response),
+        blob_len(response)
+    );
+    if (tb[ESP_RESPONSE_RC] == NULL) {
+        return -1;
+    }
+
+    struct TlvWriter writer = frame_begin(buf, buf_size);
+    tlv_put_u8(&writer, ESP_TLV_RC, (uint8_t) blobmsg_get_u32(tb[ESP_RESPONSE_RC]));
+    if (tb[ESP_RESPONSE_MSG] != NULL) {
+        tlv_put_string(&writer, ESP_TLV_MSG, blobmsg_get_string(tb[ESP_RESPONSE_MSG]));
+    }
+
+    struct blob_attr *field;
+    int rem;
+    blobmsg_for_each_attr(field, tb[ESP_RESPONSE_DATA], rem) {
+        switch (blobmsg_type(field)) {
+            case BLOBMSG_TYPE_DOUBLE:
+                tlv_put_data_field(&writer, blobmsg_name(field), blobmsg_get_double(field));
+                break;
+            case BLOBMSG_TYPE_INT32:
+                tlv_put_data_field(&writer, blobmsg_name(field), (int32_t) blobmsg_get_u32(field));
+                break;
+            case BLOBMSG_TYPE_INT64:
+                tlv_put_data_field(&writer, blobmsg_name(field), (int64_t) blobmsg_get_u64(field));
+                break;
+            default:
+                break;
+        }
+    }
+
+    return frame_end(&writer);
+}
+
+int
+esp_codec_encode_response(
+    enum EspCodec codec,
+    struct blob_attr *response,
+    char *buf,
+    int buf_size)
+{
+    switch (codec) {
+        case ESP_CODEC_JSON:
+            return encode_response_json(response, buf, buf_size);
+        case ESP_CODEC_BINARY:
+            return encode_response_binary(response, buf, buf_size);
+    }
+
+    return -1;
+}
+#endif
+
+// Calls back for every TLV in a validated payload, stops on a malformed one.
+static bool
+for_each_tlv(
+    const uint8_t *payload,
+    int payload_len,
+    void *ctx,
+    bool (*cb)(uint8_t tag, const uint8_t *value, int len, void *ctx))
+{
+    int pos = 0;
+    while (pos < payload_len) {
+        if (pos + ESP_TLV_HEADER_SIZE > payload_len) {
+            return false;
+        }
+        uint8_t tag = payload[pos];
+        int len = payload[pos + 1];
+        pos += ESP_TLV_HEADER_SIZE;
+        if (pos + len > payload_len) {
+            return false;
+        }
+        if (!cb(tag, payload + pos, len, ctx)) {
+            return false;
+        }
+        pos += len;
+    }
+
+    return true;
+}
+
+static bool
+count_data_tlv(uint8_t tag, const uint8_t *value, int len, void *ctx) {
+    if (tag == ESP_TLV_DATA_FIELD) {
+        (*(int *) ctx)++;
+    }
+    return true;
+}
+
+static bool
+decode_header_tlv(uint8_t tag, const uint8_t *value, int len, void *ctx) {
+    struct blob_buf *response_blob_buf = ctx;
+    char message[ESP_TLV_MAX_VALUE_SIZE + 1];
+    switch (tag) {
+        case ESP_TLV_RC:
+            if (len != 1) {
+                return false;
+            }
+            blobmsg_add_u32(response_blob_buf, "rc", value[0]);
+            break;
+        case ESP_TLV_MSG:
+            memcpy(message, value, len);
+            message[len] = '\0';
+            blobmsg_add_string(response_blob_buf, "msg", message);
+            break;
+        default:
+            break;
+    }
+
+    return true;
+}
+
+static bool
+decode_data_tlv(uint8_t tag, const uint8_t *value, int len, void *ctx) {
+    struct blob_buf *response_blob_buf = ctx;
+    if (tag != ESP_TLV_DATA_FIELD) {
+        return true;
+    }
+
+    const uint8_t *name_end = memchr(value, '\0', len);
+    if (name_end == NULL || value + len - (name_end + 1) != 4) {
+        return false;
+    }
+
+    uint32_t bits = 0;
+    for (int i = 0; i < 4; i++) {
+        bits |= (uint32_t) name_end[1 + i] << (8 * i);
+    }
+    float field;
+    memcpy(&field, &bits, sizeof(field));
+    blobmsg_add_double(response_blob_buf, (const char *) value, field);
+
+    return true;
+}
+
+static bool
+decode_response_binary(const char *buf, int len, struct blob_buf *response_blob_buf) {
+    if (!esp_codec_is_frame(buf, len) || esp_codec_frame_length(buf, len) > len) {
+        return false;
+    }
+
+    const uint8_t *frame = (const uint8_t *) buf;
+    int payload_len = frame[1] | (frame[2] << 8);
+    const uint8_t *payload = frame + ESP_FRAME_HEADER_SIZE;
+    const uint8_t *trailer = payload + payload_len;
+    uint16_t crc = trailer[0] | (trailer[1] << 8);
+    if (crc != crc16_ccitt(frame + 1, payload_len + ESP_FRAME_HEADER_SIZE - 1)) {
+        return false;
+    }
+
+    // Data fields are gathered in a second pass, so that they end up in a
+    // single table no matter where they appear in the frame.
+    if (!for_each_tlv(payload, payload_len, response_blob_buf, decode_header_tlv)) {
+        return false;
+    }
+    int data_field_count = 0;
+    for_each_tlv(payload, payload_len, &data_field_count, count_data_tlv);
+    if (data_field_count == 0) {
+        return true;
+    }
+    void *data_table = blobmsg_open_table(response_blob_buf, "data");
+    bool success = for_each_tlv(payload, payload_len, response_blob_buf, decode_data_tlv);
+    blobmsg_close_table(response_blob_buf, data_table);
+
+    return success;
+}
+
+bool
+esp_codec_decode_response(
+    enum EspCodec codec,
+    const char *buf,
+    int len,
+    struct blob_buf *response_blob_buf)
+{
+    switch (codec) {
+        case ESP_CODEC_JSON:
+            return blobmsg_add_json_from_string(response_blob_buf, buf);
+        case ESP_CODEC_BINARY:
+            return decode_response_binary(buf, len, response_blob_buf);
+    }
+
+    return false;
+}
+
+int
+esp_codec_frame_length(const char *buf, int len) {
+    if (len < ESP_FRAME_HEADER_SIZE) {
+        return 0;
+    }
+
+    const uint8_t *frame = (const uint8_t *) buf;
+    int payload_len = frame[1] | (frame[2] << 8);
+    return ESP_FRAME_HEADER_SIZE + payload_len + ESP_FRAME_TRAILER_SIZE;
+}
+
+bool
+esp_codec_is_frame(const char *buf, int len) {
+    return len >= ESP_FRAME_HEADER_SIZE + ESP_FRAME_TRAILER_SIZE
+        && (uint8_t) buf[0] == ESP_FRAME_MAGIC;
+}
+
+const char *EspCodec_str[] = {
+    "json",
+    "binary",
+};
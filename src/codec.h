@@ -0,0 +1,66 @@
+#pragma once
+#include <stdbool.h>
+#include <libubox/blobmsg.h>
+
+struct EspAction;
+
+enum EspCodec {
+    ESP_CODEC_JSON,
+    ESP_CODEC_BINARY,
+};
+
+extern const char *EspCodec_str[];
+
+// Fields of a decoded ESP response, the same for every codec.
+enum {
+    ESP_RESPONSE_RC,
+    ESP_RESPONSE_MSG,
+    ESP_RESPONSE_DATA,
+    __ESP_RESPONSE_MAX,
+};
+
+extern const struct blobmsg_policy esp_response_policy[];
+
+// Asks the ESP to switch to binary frames, sent and answered as JSON.
+#define ESP_CODEC_HELLO_MESSAGE "{\"action\": \"codec\", \"codec\": \"tlv\"}"
+
+// Returns the number of bytes written to buf, or -1 if it does not fit or the
+// codec cannot carry it. Binary frames only take pins 0-255.
+int
+esp_codec_encode_action(
+    enum EspCodec codec,
+    const struct EspAction *action,
+    char *buf,
+    int buf_size
+);
+
+#ifdef ESP_CODEC_ENCODE_RESPONSE
+// Encodes a message with "rc", "msg" and "data" fields the way the ESP would
+// send it, response being the head of its blob_buf. Binary frames only carry
+// numeric data fields. Built for the bench and the codec check only.
+int
+esp_codec_encode_response(
+    enum EspCodec codec,
+    struct blob_attr *response,
+    char *buf,
+    int buf_size
+);
+#endif
+
+// Adds the "rc", "msg" and "data" fields of an ESP response to response_blob_buf.
+// JSON input has to be NUL terminated.
+bool
+esp_codec_decode_response(
+    enum EspCodec codec,
+    const char *buf,
+    int len,
+    struct blob_buf *response_blob_buf
+);
+
+// Total size of the binary frame starting at buf, or 0 if the header has not
+// been received yet.
+int
+esp_codec_frame_length(const char *buf, int len);
+
+bool
+esp_codec_is_frame(const char *buf, int len);
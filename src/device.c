@@ -0,0 +1,214 @@
+#include "device.h"
+#include "esp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libubox/avl-cmp.h>
+
+static AVL_TREE(g_esp_devices, avl_strcmp, false, NULL);
+static bool g_reset_on_recovery = false;
+static unsigned int g_sync_generation = 0;
+
+static void
+probe_esp_device(struct CircuitBreaker *breaker) {
+    struct EspDevice *device = container_of(breaker, struct EspDevice, breaker);
+    start_esp_probe(device, g_reset_on_recovery);
+}
+
+struct EspDevice *
+find_esp_device(const char *port_name) {
+    struct EspDevice *device;
+    return avl_find_element(&g_esp_devices, port_name, device, node);
+}
+
+struct EspDevice *
+get_esp_device(const char *port_name) {
+    struct EspDevice *device = find_esp_device(port_name);
+    if (device != NULL) {
+        return device;
+    }
+
+    device = (struct EspDevice *) calloc(1, sizeof(struct EspDevice));
+    if (device == NULL) {
+        return NULL;
+    }
+    device->port_name = strdup(port_name);
+    if (device->port_name == NULL) {
+        free(device);
+        return NULL;
+    }
+    CircuitBreaker_init(&device->breaker, device->port_name, probe_esp_device);
+    EspProbe_init(&device->probe);
+    device->object.device = device;
+    device->alias_object.device = device;
+    EspRequestQueue_init(&device->queue);
+
+    device->node.key = device->port_name;
+    avl_insert(&g_esp_devices, &device->node);
+
+    return device;
+}
+
+enum UsbResult
+lookup_esp_device(const char *port_name, struct EspDevice **device) {
+    *device = find_esp_device(port_name);
+    if (*device != NULL) {
+        return USB_RESULT_OK;
+    }
+
+    struct sp_port *port = NULL;
+    enum UsbResult usb_result = get_esp_port_by_name(port_name, &port);
+    if (usb_result != USB_RESULT_OK) {
+        return usb_result;
+    }
+    sp_free_port(port);
+
+    *device = get_esp_device(port_name);
+    return *device != NULL ? USB_RESULT_OK : USB_RESULT_ERR_UNKNOWN;
+}
+
+static void
+EspDevice_free(struct EspDevice *device) {
+    avl_delete(&g_esp_devices, &device->node);
+    EspProbe_free(&device->probe);
+    CircuitBreaker_free(&device->breaker);
+    EspRequestQueue_free(&device->queue, USB_RESULT_ERR_PORT_NOT_FOUND);
+    if (device->port != NULL) {
+        sp_free_port(device->port);
+    }
+    free(device->serial_number);
+    free(device->usb_path);
+    free(device->object.name);
+    free(device->alias_object.name);
+    free(device->port_name);
+    free(device);
+}
+
+static bool
+attach_esp_port(struct EspDevice *device, const struct sp_port *port) {
+    if (sp_copy_port(port, &device->port) != SP_OK) {
+        device->port = NULL;
+        return false;
+    }
+
+    char *serial_number = sp_get_port_usb_serial(device->port);
+    if (serial_number != NULL) {
+        device->serial_number = strdup(serial_number);
+    }
+    device->usb_path = get_esp_port_usb_path(device->port_name);
+
+    return true;
+}
+
+// A different ESP may have been plugged into the port between two scans.
+static bool
+esp_port_replaced(const struct EspDevice *device, const struct sp_port *port) {
+    const char *serial_number = sp_get_port_usb_serial(port);
+    if (serial_number == NULL || device->serial_number == NULL) {
+        return serial_number != device->serial_number;
+    }
+    return strcmp(serial_number, device->serial_number) != 0;
+}
+
+static void
+mark_esp_serial_conflicts(void) {
+    struct EspDevice *device, *other;
+    avl_for_each_element(&g_esp_devices, device, node) {
+        device->serial_conflict = false;
+        if (device->port == NULL || device->serial_number == NULL) {
+            continue;
+        }
+        avl_for_each_element(&g_esp_devices, other, node) {
+            if (other != device
+                && other->port != NULL
+                && other->serial_number != NULL
+                && strcmp(other->serial_number, device->serial_number) == 0) {
+                device->serial_conflict = true;
+                break;
+            }
+        }
+    }
+}
+
+enum UsbResult
+sync_esp_devices(esp_device_cb_t attached, esp_device_cb_t detached) {
+    struct sp_port **port_list;
+    enum UsbResult usb_result = enumerate_esp_serial_ports(&port_list);
+    if (usb_result != USB_RESULT_OK) {
+        return usb_result;
+    }
+
+    g_sync_generation++;
+    for (int i = 0; port_list[i] != NULL; i++) {
+        const char *port_name = sp_get_port_name(port_list[i]);
+        struct EspDevice *device = find_esp_device(port_name);
+        // Breaker, codec and queue belonged to the previous ESP.
+        if (device != NULL && device->port != NULL && esp_port_replaced(device, port_list[i])) {
+            detached(device);
+            EspDevice_free(device);
+        }
+
+        device = get_esp_device(port_name);
+        if (device == NULL) {
+            continue;
+        }
+        device->generation = g_sync_generation;
+
+        if (device->port == NULL && attach_esp_port(device, port_list[i])) {
+            attached(device);
+        }
+    }
+    sp_free_port_list(port_list);
+
+    struct EspDevice *device, *tmp;
+    avl_for_each_element_safe(&g_esp_devices, device, node, tmp) {
+        if (device->generation == g_sync_generation) {
+            continue;
+        }
+        detached(device);
+        EspDevice_free(device);
+    }
+    mark_esp_serial_conflicts();
+
+    return USB_RESULT_OK;
+}
+
+void
+for_each_esp_device(esp_device_iter_cb_t cb, void *ctx) {
+    struct EspDevice *device;
+    avl_for_each_element(&g_esp_devices, device, node) {
+        cb(device, ctx);
+    }
+}
+
+bool
+get_esp_device_alias(const struct EspDevice *device, char *alias, int alias_size) {
+    if (device->serial_number == NULL) {
+        return false;
+    }
+    if (!device->serial_conflict) {
+        snprintf(alias, alias_size, "usb-%s", device->serial_number);
+        return true;
+    }
+    // Plugging ESPs with the same serial number into other USB ports swaps their
+    // aliases, but at least they no longer depend on enumeration order.
+    if (device->usb_path == NULL) {
+        return false;
+    }
+    snprintf(alias, alias_size, "usb-%s-%s", device->serial_number, device->usb_path);
+    return true;
+}
+
+void
+free_esp_devices(esp_device_cb_t detached) {
+    struct EspDevice *device, *tmp;
+    avl_for_each_element_safe(&g_esp_devices, device, node, tmp) {
+        detached(device);
+        EspDevice_free(device);
+    }
+}
+
+void
+set_esp_device_reset_on_recovery(bool reset_on_recovery) {
+    g_reset_on_recovery = reset_on_recovery;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "breaker.h"
+#include "codec.h"
+#include "queue.h"
+#include <stdbool.h>
+#include <libubox/avl.h>
+#include <libubus.h>
+
+struct EspDevice;
+
+// Ubus object published for a single ESP, methods act on device directly.
+struct EspDeviceObject {
+    struct ubus_object object;
+    char *name;
+    struct EspDevice *device;
+};
+
+// Daemon side state kept for every ESP port that has been talked to.
+struct EspDevice {
+    struct avl_node node;
+    char *port_name;
+
+    // Set once the port has been found by sync_esp_devices.
+    struct sp_port *port;
+    char *serial_number;
+    char *usb_path;
+    // Another attached ESP reports the same serial number.
+    bool serial_conflict;
+    unsigned int generation;
+
+    struct CircuitBreaker breaker;
+    struct EspProbe probe;
+
+    enum EspCodec codec;
+    bool codec_negotiated;
+
+    struct EspRequestQueue queue;
+
+    struct EspDeviceObject object;
+    struct EspDeviceObject alias_object;
+};
+
+typedef void (*esp_device_cb_t)(struct EspDevice *device);
+typedef void (*esp_device_iter_cb_t)(struct EspDevice *device, void *ctx);
+
+// Returns NULL if the port has not been used yet.
+struct EspDevice *
+find_esp_device(const char *port_name);
+
+// Returns NULL on allocation failure.
+struct EspDevice *
+get_esp_device(const char *port_name);
+
+// Like get_esp_device, but checks that an ESP is attached first, unless the port
+// has been used before.
+enum UsbResult
+lookup_esp_device(const char *port_name, struct EspDevice **device);
+
+// Matches the known devices to the ESPs currently attached. attached is called
+// for every newly found ESP, detached right before a vanished device is freed. A
+// port that reports another serial number than before counts as both.
+enum UsbResult
+sync_esp_devices(esp_device_cb_t attached, esp_device_cb_t detached);
+
+void
+for_each_esp_device(esp_device_iter_cb_t cb, void *ctx);
+
+// Name that follows the ESP rather than the port, "usb-<serial>", or with the USB
+// path appended while several ESPs share the serial number. Returns false if the
+// device has none.
+bool
+get_esp_device_alias(const struct EspDevice *device, char *alias, int alias_size);
+
+// detached is called for every device before it is freed.
+void
+free_esp_devices(esp_device_cb_t detached);
+
+// Toggle DTR/RTS to reset the ESP when a health probe fails.
+void
+set_esp_device_reset_on_recovery(bool reset_on_recovery);
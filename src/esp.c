@@ -1,18 +1,13 @@
 #include "esp.h"
 #include "serial.h"
+#include "device.h"
+#include "clock.h"
 #include <stdio.h>
 
 #define ESP_SERIAL_READ_BUFFER_SIZE 1024
-#define ESP_SERIAL_WRITE_BUFFER_SIZE 1024
-#define ESP_TOGGLE_PIN_FORMAT "{\"action\": \"%s\", \"pin\": %i}"
-#define ESP_GET_SENSOR_FORMAT "{\"action\": \"get\", \"sensor\": \"%s\", \"pin\": %i, \"model\": \"%s\"}"
-
-enum {
-    ESP_RESPONSE_RC,
-    ESP_RESPONSE_MSG,
-    ESP_RESPONSE_DATA,
-    __ESP_RESPONSE_MAX,
-};
+// Any reply, even an error about the unknown action, proves the ESP is alive.
+#define ESP_PROBE_MESSAGE "{\"action\": \"ping\"}"
+#define ESP_PROBE_TIMEOUT_MS 500
 
 struct EspResponse {
     bool success;
@@ -20,102 +15,358 @@ struct EspResponse {
     char *data;
 };
 
-static const struct blobmsg_policy
-esp_response_policy[] = {
-    [ESP_RESPONSE_RC] = {.name = "rc", .type = BLOBMSG_TYPE_INT32},
-    [ESP_RESPONSE_MSG] = {.name = "msg", .type = BLOBMSG_TYPE_STRING},
-    [ESP_RESPONSE_DATA] = {.name = "data", .type = BLOBMSG_TYPE_TABLE},
-};
+static enum EspCodec g_preferred_codec = ESP_CODEC_JSON;
+static esp_sensor_reading_t g_sensor_reading_cb = NULL;
 
 static struct EspResponse EspResponse_new(void);
 
 static void EspResponse_free(struct EspResponse *esp_response);
 
-struct EspActionResult
-execute_esp_action(struct EspAction action) {
-    struct EspActionResult result = {
-        .usb_result = USB_RESULT_OK,
-        .esp_response_string = NULL
-    };
+static bool
+parse_esp_response(const struct EspActionResult *esp_result, struct EspResponse *esp_response);
 
-    struct sp_port *port = NULL;
-    result.usb_result = get_esp_port_by_name(action.port_name, &port);
-    if (result.usb_result != USB_RESULT_OK) {
-        return result;
-    }
-
-    char serial_write_buf[1024];
-    switch (action.action_type) {
-        case ESP_ACTION_ON:
-            snprintf(
-                serial_write_buf,
-                sizeof(serial_write_buf),
-                ESP_TOGGLE_PIN_FORMAT,
-                "on",
-                action.pin
-            );
-            break;
-        case ESP_ACTION_OFF:
-            snprintf(
-                serial_write_buf,
-                sizeof(serial_write_buf),
-                ESP_TOGGLE_PIN_FORMAT,
-                "off",
-                action.pin
-            );
-            break;
-        case ESP_ACTION_GET_SENSOR:
-            snprintf(
-                serial_write_buf,
-                sizeof(serial_write_buf),
-                ESP_GET_SENSOR_FORMAT,
-                action.sensor,
-                action.pin,
-                action.model
-            );
-            break;
+// Leaves the device on JSON unless the ESP acknowledges the binary codec. Returns
+// false if there is nothing to negotiate, otherwise the hello has to be sent.
+static bool
+start_esp_codec_negotiation(struct EspDevice *device) {
+    device->codec = ESP_CODEC_JSON;
+    if (g_preferred_codec == ESP_CODEC_JSON) {
+        device->codec_negotiated = true;
+        return false;
+    }
+    return true;
+}
+
+// A failed exchange is retried with the next request.
+static void
+end_esp_codec_negotiation(struct EspDevice *device, const struct EspActionResult *hello) {
+    if (hello->usb_result != USB_RESULT_OK) {
+        return;
     }
 
-    char *serial_read_buf = (char *) calloc(ESP_SERIAL_READ_BUFFER_SIZE, sizeof(char));
-    if (serial_read_buf == NULL) {
-        goto cleanup_port;
+    struct EspResponse esp_response = EspResponse_new();
+    if (parse_esp_response(hello, &esp_response) && esp_response.success) {
+        device->codec = ESP_CODEC_BINARY;
     }
+    EspResponse_free(&esp_response);
+    device->codec_negotiated = true;
+}
 
-    result.usb_result = open_port(port);
-    if (result.usb_result != USB_RESULT_OK) {
+// Hands the response over to result and lets the device learn from the exchange.
+static void
+end_esp_action(
+    struct EspDevice *device,
+    const struct EspAction *action,
+    struct EspActionResult *result,
+    char *serial_read_buf)
+{
+    if (result->usb_result != USB_RESULT_OK) {
         free(serial_read_buf);
         serial_read_buf = NULL;
-        goto cleanup_open_port;
     }
+    result->esp_response_string = serial_read_buf;
+
+    circuit_breaker_record_result(&device->breaker, result->usb_result);
+
+    // An ESP answering binary frames with anything else has most likely been
+    // reflashed, so its reply is read as JSON and the codec renegotiated.
+    if (result->usb_result == USB_RESULT_OK
+        && result->codec == ESP_CODEC_BINARY
+        && !esp_codec_is_frame(serial_read_buf, result->esp_response_length)) {
+        result->codec = ESP_CODEC_JSON;
+        device->codec_negotiated = false;
+    }
+
+    if (g_sensor_reading_cb != NULL
+        && action->action_type == ESP_ACTION_GET_SENSOR
+        && result->usb_result == USB_RESULT_OK) {
+        g_sensor_reading_cb(action, result);
+    }
+}
+
+static void
+close_esp_action_run(struct EspActionRun *run) {
+    if (run->port != NULL) {
+        sp_close(run->port);
+        if (run->owns_port) {
+            sp_free_port(run->port);
+        }
+        run->port = NULL;
+    }
+    free(run->serial_read_buf);
+    run->serial_read_buf = NULL;
+}
+
+static void
+action_run_transfer_done(struct SerialTransfer *transfer);
+
+static enum UsbResult
+send_esp_action_run(
+    struct EspActionRun *run,
+    const char *input_buf,
+    int write_bytes,
+    response_length_t response_length)
+{
+    // Always NUL terminated, so JSON responses can be parsed in place.
+    memset(run->serial_read_buf, 0, ESP_SERIAL_READ_BUFFER_SIZE);
+    run->transfer.exchange = (struct SerialExchange) {
+        .port = run->port,
+        .input_buf = input_buf,
+        .write_bytes = write_bytes,
+        .response_buf = run->serial_read_buf,
+        .read_bytes = ESP_SERIAL_READ_BUFFER_SIZE - 1,
+        .response_length = response_length,
+    };
+    run->transfer.done = action_run_transfer_done;
+
+    return start_serial_transfer(&run->transfer, run->deadline_ms);
+}
 
-    result.usb_result = write_and_await_response(
-        port,
-        serial_write_buf,
-        strlen(serial_write_buf),
-        serial_read_buf,
-        ESP_SERIAL_READ_BUFFER_SIZE
+static enum UsbResult
+send_esp_action(struct EspActionRun *run) {
+    run->result.codec = run->device->codec;
+    int write_len = esp_codec_encode_action(
+        run->result.codec,
+        run->action,
+        run->serial_write_buf,
+        ESP_SERIAL_WRITE_BUFFER_SIZE
     );
-    if (result.usb_result != USB_RESULT_OK) {
-        free(serial_read_buf);
-        serial_read_buf = NULL;
+    if (write_len < 0) {
+        return USB_RESULT_ERR_UNKNOWN;
     }
-    result.esp_response_string = serial_read_buf;
 
-cleanup_open_port:
-    sp_close(port);
-cleanup_port:
-    sp_free_port(port);
+    return send_esp_action_run(
+        run,
+        run->serial_write_buf,
+        write_len,
+        run->result.codec == ESP_CODEC_BINARY ? esp_codec_frame_length : NULL
+    );
+}
+
+static void
+fail_esp_action_run(struct EspActionRun *run, enum UsbResult usb_result) {
+    run->result.usb_result = usb_result;
+    close_esp_action_run(run);
+    run->done(run);
+}
+
+static void
+action_run_transfer_done(struct SerialTransfer *transfer) {
+    struct EspActionRun *run = container_of(transfer, struct EspActionRun, transfer);
+    if (run->negotiating) {
+        run->negotiating = false;
+        struct EspActionResult hello = {
+            .usb_result = transfer->exchange.usb_result,
+            .esp_response_string = run->serial_read_buf,
+            .esp_response_length = transfer->exchange.response_len,
+            .codec = ESP_CODEC_JSON,
+        };
+        end_esp_codec_negotiation(run->device, &hello);
+        if (hello.usb_result == USB_RESULT_ERR_DEADLINE) {
+            fail_esp_action_run(run, USB_RESULT_ERR_DEADLINE);
+            return;
+        }
 
-    return result;
+        enum UsbResult usb_result = send_esp_action(run);
+        if (usb_result != USB_RESULT_OK) {
+            fail_esp_action_run(run, usb_result);
+        }
+        return;
+    }
+
+    run->result.usb_result = transfer->exchange.usb_result;
+    run->result.esp_response_length = transfer->exchange.response_len;
+    end_esp_action(run->device, run->action, &run->result, run->serial_read_buf);
+    run->serial_read_buf = NULL;
+    close_esp_action_run(run);
+    run->done(run);
+}
+
+enum UsbResult
+start_esp_action_run(
+    struct EspActionRun *run,
+    struct EspDevice *device,
+    const struct EspAction *action,
+    long deadline_ms)
+{
+    run->device = device;
+    run->action = action;
+    run->deadline_ms = deadline_ms;
+    run->negotiating = false;
+    run->result = (struct EspActionResult) {
+        .usb_result = USB_RESULT_OK,
+        .esp_response_string = NULL,
+        .esp_response_length = 0,
+        .codec = ESP_CODEC_JSON,
+    };
+
+    enum UsbResult usb_result = USB_RESULT_ERR_PORT_UNAVAILABLE;
+    if (!circuit_breaker_allows_request(&device->breaker)) {
+        goto failure;
+    }
+
+    // Devices which have not been picked up by the hotplug scan yet are
+    // reached by name.
+    run->owns_port = device->port == NULL;
+    run->port = device->port;
+    if (run->owns_port) {
+        usb_result = get_esp_port_by_name(action->port_name, &run->port);
+        if (usb_result != USB_RESULT_OK) {
+            goto failure;
+        }
+    }
+
+    run->serial_read_buf = (char *) malloc(ESP_SERIAL_READ_BUFFER_SIZE);
+    if (run->serial_read_buf == NULL) {
+        usb_result = USB_RESULT_ERR_UNKNOWN;
+        goto failure;
+    }
+    usb_result = open_port(run->port);
+    if (usb_result != USB_RESULT_OK) {
+        goto failure;
+    }
+
+    if (!device->codec_negotiated && start_esp_codec_negotiation(device)) {
+        run->negotiating = true;
+        usb_result = send_esp_action_run(run, ESP_CODEC_HELLO_MESSAGE, strlen(ESP_CODEC_HELLO_MESSAGE), NULL);
+    } else {
+        usb_result = send_esp_action(run);
+    }
+    if (usb_result == USB_RESULT_OK) {
+        return usb_result;
+    }
+
+failure:
+    run->result.usb_result = usb_result;
+    close_esp_action_run(run);
+    return usb_result;
+}
+
+void
+cancel_esp_action_run(struct EspActionRun *run) {
+    cancel_serial_transfer(&run->transfer);
+    close_esp_action_run(run);
+}
+
+void
+set_esp_preferred_codec(enum EspCodec codec) {
+    g_preferred_codec = codec;
+}
+
+void
+set_esp_sensor_reading_cb(esp_sensor_reading_t cb) {
+    g_sensor_reading_cb = cb;
+}
+
+// The first byte of any reply is enough to tell.
+static int
+probe_response_length(const char *buf, int len) {
+    return 1;
+}
+
+static void
+close_esp_probe_port(struct EspProbe *probe) {
+    if (probe->port != NULL) {
+        sp_close(probe->port);
+        sp_free_port(probe->port);
+        probe->port = NULL;
+    }
+}
+
+static void
+probe_reset_timeout_cb(struct uloop_timeout *timeout) {
+    struct EspProbe *probe = container_of(timeout, struct EspProbe, reset_timeout);
+    release_esp_reset(probe->port);
+    close_esp_probe_port(probe);
+}
+
+static void
+end_esp_probe(struct EspProbe *probe, enum UsbResult usb_result) {
+    struct EspDevice *device = container_of(probe, struct EspDevice, probe);
+
+    // The next probe will find the ESP freshly booted. The port stays open
+    // until the pulse is over.
+    if (usb_result != USB_RESULT_OK
+        && probe->reset_on_failure
+        && probe->port != NULL
+        && assert_esp_reset(probe->port) == USB_RESULT_OK) {
+        uloop_timeout_set(&probe->reset_timeout, ESP_RESET_PULSE_MS);
+    } else {
+        close_esp_probe_port(probe);
+    }
+
+    circuit_breaker_record_result(&device->breaker, usb_result);
+}
+
+static void
+probe_transfer_done(struct SerialTransfer *transfer) {
+    struct EspProbe *probe = container_of(transfer, struct EspProbe, transfer);
+    end_esp_probe(probe, transfer->exchange.usb_result);
+}
+
+void
+EspProbe_init(struct EspProbe *probe) {
+    *probe = (struct EspProbe) {};
+    probe->reset_timeout.cb = probe_reset_timeout_cb;
+}
+
+void
+EspProbe_free(struct EspProbe *probe) {
+    cancel_serial_transfer(&probe->transfer);
+    if (probe->reset_timeout.pending) {
+        uloop_timeout_cancel(&probe->reset_timeout);
+        release_esp_reset(probe->port);
+    }
+    close_esp_probe_port(probe);
+}
+
+void
+start_esp_probe(struct EspDevice *device, bool reset_on_failure) {
+    struct EspProbe *probe = &device->probe;
+    // A reset still in progress counts as the previous probe.
+    if (probe->transfer.timeout.pending || probe->reset_timeout.pending) {
+        return;
+    }
+    probe->reset_on_failure = reset_on_failure;
+
+    enum UsbResult usb_result = get_esp_port_by_name(device->port_name, &probe->port);
+    if (usb_result != USB_RESULT_OK) {
+        goto failure;
+    }
+    usb_result = open_port(probe->port);
+    if (usb_result != USB_RESULT_OK) {
+        goto failure;
+    }
+
+    probe->transfer.exchange = (struct SerialExchange) {
+        .port = probe->port,
+        .input_buf = ESP_PROBE_MESSAGE,
+        .write_bytes = strlen(ESP_PROBE_MESSAGE),
+        .response_buf = probe->serial_read_buf,
+        .read_bytes = sizeof(probe->serial_read_buf),
+        .response_length = probe_response_length,
+    };
+    probe->transfer.done = probe_transfer_done;
+    usb_result = start_serial_transfer(&probe->transfer, monotonic_ms() + ESP_PROBE_TIMEOUT_MS);
+    if (usb_result == USB_RESULT_OK) {
+        return;
+    }
+
+failure:
+    end_esp_probe(probe, usb_result);
 }
 
 static bool
-parse_esp_response(char *esp_response_json_string, struct EspResponse *esp_response) {
+parse_esp_response(const struct EspActionResult *esp_result, struct EspResponse *esp_response) {
     bool parse_success = true;
     struct blob_buf blob_buf = {};
     blob_buf_init(&blob_buf, 0);
-    // blobbuf takes ownership of esp_response_json_string
-    blobmsg_add_json_from_string(&blob_buf, esp_response_json_string);
+    esp_codec_decode_response(
+        esp_result->codec,
+        esp_result->esp_response_string,
+        esp_result->esp_response_length,
+        &blob_buf
+    );
     struct blob_attr *tb[__ESP_RESPONSE_MAX];
     blobmsg_parse(
         esp_response_policy,
@@ -164,9 +415,9 @@ create_esp_action_result_message(
     }
 
     struct EspResponse esp_response = EspResponse_new();
-    if (!parse_esp_response(esp_result.esp_response_string, &esp_response)) {
+    if (!parse_esp_response(&esp_result, &esp_response)) {
         blobmsg_add_string(result_blob_buf, "result", "err");
-        blobmsg_add_string(result_blob_buf, "message", "Failed to parse ESP response JSON.");
+        blobmsg_add_string(result_blob_buf, "message", "Failed to parse ESP response.");
         goto end;
     }
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "serial.h"
+#include "codec.h"
 #include <libubox/blobmsg_json.h>
 
 enum EspActionType {
@@ -21,10 +22,86 @@ struct EspAction {
 struct EspActionResult {
     enum UsbResult usb_result;
     char *esp_response_string;
+    int esp_response_length;
+    enum EspCodec codec;
 };
 
-struct EspActionResult
-execute_esp_action(struct EspAction action);
+struct EspDevice;
+
+typedef void (*esp_sensor_reading_t)(const struct EspAction *action, const struct EspActionResult *result);
+
+#define ESP_SERIAL_WRITE_BUFFER_SIZE 1024
+
+struct EspActionRun;
+
+typedef void (*esp_action_run_done_t)(struct EspActionRun *run);
+
+// Action driven by uloop, codec negotiation included, so that the other ports are
+// served while the ESP answers. Only touched by esp.c apart from done and result.
+struct EspActionRun {
+    esp_action_run_done_t done;
+    // Belongs to the caller once done is called, freed with EspActionResult_free.
+    struct EspActionResult result;
+
+    struct EspDevice *device;
+    const struct EspAction *action;
+    long deadline_ms;
+    struct sp_port *port;
+    bool owns_port;
+    bool negotiating;
+    struct SerialTransfer transfer;
+    char serial_write_buf[ESP_SERIAL_WRITE_BUFFER_SIZE];
+    char *serial_read_buf;
+};
+
+// Starts the action on device and returns right away. done is called from uloop
+// once it is over, at the latest at deadline_ms on the monotonic clock. If it
+// could not be started the error is returned, also in result, and done is never
+// called. action has to stay valid until then.
+enum UsbResult
+start_esp_action_run(
+    struct EspActionRun *run,
+    struct EspDevice *device,
+    const struct EspAction *action,
+    long deadline_ms
+);
+
+// Stops a running action without calling done. Does nothing to a zeroed or
+// finished run.
+void
+cancel_esp_action_run(struct EspActionRun *run);
+
+// Codec offered to every ESP the first time it is used. JSON needs no negotiation.
+void
+set_esp_preferred_codec(enum EspCodec codec);
+
+// Called with every sensor reading the ESP answered, whichever path asked for it.
+void
+set_esp_sensor_reading_cb(esp_sensor_reading_t cb);
+
+#define ESP_PROBE_READ_BUFFER_SIZE 64
+
+// Health check of a device whose breaker is open, run from uloop so that the
+// other ports are served while the ESP does not answer.
+struct EspProbe {
+    struct SerialTransfer transfer;
+    struct sp_port *port;
+    bool reset_on_failure;
+    struct uloop_timeout reset_timeout;
+    char serial_read_buf[ESP_PROBE_READ_BUFFER_SIZE];
+};
+
+void
+EspProbe_init(struct EspProbe *probe);
+
+// Stops a running probe without reporting it.
+void
+EspProbe_free(struct EspProbe *probe);
+
+// Checks whether the ESP answers at all and reports to the breaker of the device,
+// optionally resetting the ESP if it does not.
+void
+start_esp_probe(struct EspDevice *device, bool reset_on_failure);
 
 struct blob_buf *
 create_esp_action_result_message(
@@ -0,0 +1,194 @@
+#include "group.h"
+#include <stdlib.h>
+#include <string.h>
+#include <libubox/avl-cmp.h>
+#include <libubox/blobmsg_json.h>
+
+enum {
+    ESP_GROUP_MEMBER_POLICY_PORT,
+    ESP_GROUP_MEMBER_POLICY_PIN,
+    __ESP_GROUP_MEMBER_POLICY_MAX,
+};
+
+static const struct blobmsg_policy
+esp_group_member_policy[] = {
+    [ESP_GROUP_MEMBER_POLICY_PORT] = {.name = "port", .type = BLOBMSG_TYPE_STRING},
+    [ESP_GROUP_MEMBER_POLICY_PIN] = {.name = "pin", .type = BLOBMSG_TYPE_INT32},
+};
+
+enum {
+    ESP_GROUP_FILE_POLICY_GROUPS,
+    __ESP_GROUP_FILE_POLICY_MAX,
+};
+
+static const struct blobmsg_policy
+esp_group_file_policy[] = {
+    [ESP_GROUP_FILE_POLICY_GROUPS] = {.name = "groups", .type = BLOBMSG_TYPE_TABLE},
+};
+
+static AVL_TREE(g_esp_groups, avl_strcmp, false, NULL);
+
+static void
+EspGroup_free(struct EspGroup *group) {
+    for (int i = 0; i < group->member_count; i++) {
+        free(group->members[i].port_name);
+    }
+    free(group->name);
+    free(group);
+}
+
+static bool
+parse_esp_group_member(struct blob_attr *attr, struct blob_attr **tb) {
+    if (blobmsg_type(attr) != BLOBMSG_TYPE_TABLE) {
+        return false;
+    }
+    blobmsg_parse(
+        esp_group_member_policy,
+        __ESP_GROUP_MEMBER_POLICY_MAX,
+        tb,
+        blobmsg_data(attr),
+        blobmsg_data_len(attr)
+    );
+    return tb[ESP_GROUP_MEMBER_POLICY_PORT] != NULL && tb[ESP_GROUP_MEMBER_POLICY_PIN] != NULL;
+}
+
+enum EspGroupResult
+set_esp_group(const char *name, struct blob_attr *members) {
+    if (blobmsg_type(members) != BLOBMSG_TYPE_ARRAY) {
+        return ESP_GROUP_RESULT_ERR_INVALID;
+    }
+
+    // Validate everything up front, so that a bad member leaves the old group alone.
+    struct blob_attr *tb[__ESP_GROUP_MEMBER_POLICY_MAX];
+    struct blob_attr *member;
+    int rem;
+    int member_count = 0;
+    blobmsg_for_each_attr(member, members, rem) {
+        if (!parse_esp_group_member(member, tb)) {
+            return ESP_GROUP_RESULT_ERR_INVALID;
+        }
+        member_count++;
+    }
+    if (member_count == 0 || member_count > ESP_GROUP_MAX_MEMBERS) {
+        return ESP_GROUP_RESULT_ERR_INVALID;
+    }
+
+    struct EspGroup *group = calloc(1, sizeof(struct EspGroup) + member_count * sizeof(struct EspGroupMember));
+    if (group == NULL) {
+        return ESP_GROUP_RESULT_ERR_MEMORY;
+    }
+    group->name = strdup(name);
+    if (group->name == NULL) {
+        EspGroup_free(group);
+        return ESP_GROUP_RESULT_ERR_MEMORY;
+    }
+    blobmsg_for_each_attr(member, members, rem) {
+        parse_esp_group_member(member, tb);
+        struct EspGroupMember *group_member = &group->members[group->member_count];
+        group_member->port_name = strdup(blobmsg_get_string(tb[ESP_GROUP_MEMBER_POLICY_PORT]));
+        group_member->pin = blobmsg_get_u32(tb[ESP_GROUP_MEMBER_POLICY_PIN]);
+        group->member_count++;
+        if (group_member->port_name == NULL) {
+            EspGroup_free(group);
+            return ESP_GROUP_RESULT_ERR_MEMORY;
+        }
+    }
+
+    delete_esp_group(name);
+    group->node.key = group->name;
+    avl_insert(&g_esp_groups, &group->node);
+
+    return ESP_GROUP_RESULT_OK;
+}
+
+enum EspGroupResult
+delete_esp_group(const char *name) {
+    struct EspGroup *group = find_esp_group(name);
+    if (group == NULL) {
+        return ESP_GROUP_RESULT_ERR_NOT_FOUND;
+    }
+
+    avl_delete(&g_esp_groups, &group->node);
+    EspGroup_free(group);
+
+    return ESP_GROUP_RESULT_OK;
+}
+
+struct EspGroup *
+find_esp_group(const char *name) {
+    struct EspGroup *group;
+    return avl_find_element(&g_esp_groups, name, group, node);
+}
+
+enum EspGroupResult
+load_esp_groups(const char *path) {
+    enum EspGroupResult result = ESP_GROUP_RESULT_OK;
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    if (!blobmsg_add_json_from_file(&blob_buf, path)) {
+        result = ESP_GROUP_RESULT_ERR_FILE;
+        goto end;
+    }
+
+    struct blob_attr *tb[__ESP_GROUP_FILE_POLICY_MAX];
+    blobmsg_parse(
+        esp_group_file_policy,
+        __ESP_GROUP_FILE_POLICY_MAX,
+        tb,
+        blob_data(blob_buf.head),
+        blob_len(blob_buf.head)
+    );
+    if (tb[ESP_GROUP_FILE_POLICY_GROUPS] == NULL) {
+        result = ESP_GROUP_RESULT_ERR_INVALID;
+        goto end;
+    }
+
+    struct blob_attr *group;
+    int rem;
+    blobmsg_for_each_attr(group, tb[ESP_GROUP_FILE_POLICY_GROUPS], rem) {
+        result = set_esp_group(blobmsg_name(group), group);
+        if (result != ESP_GROUP_RESULT_OK) {
+            break;
+        }
+    }
+
+end:
+    blob_buf_free(&blob_buf);
+    return result;
+}
+
+struct blob_buf *
+create_esp_groups_message(struct blob_buf *result_blob_buf) {
+    void *groups_table = blobmsg_open_table(result_blob_buf, "groups");
+    struct EspGroup *group;
+    avl_for_each_element(&g_esp_groups, group, node) {
+        void *members_array = blobmsg_open_array(result_blob_buf, group->name);
+        for (int i = 0; i < group->member_count; i++) {
+            void *member_table = blobmsg_open_table(result_blob_buf, NULL);
+            blobmsg_add_string(result_blob_buf, "port", group->members[i].port_name);
+            blobmsg_add_u32(result_blob_buf, "pin", group->members[i].pin);
+            blobmsg_close_table(result_blob_buf, member_table);
+        }
+        blobmsg_close_array(result_blob_buf, members_array);
+    }
+    blobmsg_close_table(result_blob_buf, groups_table);
+
+    return result_blob_buf;
+}
+
+void
+free_esp_groups(void) {
+    struct EspGroup *group, *tmp;
+    avl_for_each_element_safe(&g_esp_groups, group, node, tmp) {
+        avl_delete(&g_esp_groups, &group->node);
+        EspGroup_free(group);
+    }
+}
+
+const char *EspGroupResult_str[] = {
+    "Success.",
+    "Group definition is invalid.",
+    "Group does not exist.",
+    "Failed to read group file.",
+    "Out of memory.",
+};
@@ -0,0 +1,49 @@
+#pragma once
+#include <libubox/avl.h>
+#include <libubox/blobmsg.h>
+
+#define ESP_GROUP_MAX_MEMBERS 32
+
+struct EspGroupMember {
+    char *port_name;
+    int pin;
+};
+
+// Named set of pins, driven together by the group_* ubus methods.
+struct EspGroup {
+    struct avl_node node;
+    char *name;
+    int member_count;
+    struct EspGroupMember members[];
+};
+
+enum EspGroupResult {
+    ESP_GROUP_RESULT_OK,
+    ESP_GROUP_RESULT_ERR_INVALID,
+    ESP_GROUP_RESULT_ERR_NOT_FOUND,
+    ESP_GROUP_RESULT_ERR_FILE,
+    ESP_GROUP_RESULT_ERR_MEMORY,
+};
+
+extern const char *EspGroupResult_str[];
+
+// members is a blobmsg array of {"port": string, "pin": int} tables. Replaces
+// any group of the same name.
+enum EspGroupResult
+set_esp_group(const char *name, struct blob_attr *members);
+
+enum EspGroupResult
+delete_esp_group(const char *name);
+
+struct EspGroup *
+find_esp_group(const char *name);
+
+// Reads {"groups": {"<name>": [members...]}} from a JSON file.
+enum EspGroupResult
+load_esp_groups(const char *path);
+
+struct blob_buf *
+create_esp_groups_message(struct blob_buf *result_blob_buf);
+
+void
+free_esp_groups(void);
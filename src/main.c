@@ -1,15 +1,83 @@
 #include <libubus.h>
 #include <sys/syslog.h>
 #include <syslog.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "ubus.h"
+#include "device.h"
+#include "esp.h"
+#include "queue.h"
+#include "trace.h"
+#include "group.h"
 
 #define SYSLOG_OPTIONS LOG_PID | LOG_NDELAY
+#define USAGE_FORMAT "Usage: %s [-b] [-c group_file] [-g global_limit] [-p port_limit] [-r]\n"
 
 static struct ubus_context *g_ubus_context;
 
-int main(void) {
+// Accepts only a plain decimal number, a typo must not end up as 0, which
+// disables the limit.
+static bool
+parse_request_limit(const char *arg, unsigned int *limit) {
+    if (*arg < '0' || *arg > '9') {
+        return false;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || value > UINT_MAX) {
+        return false;
+    }
+    *limit = value;
+
+    return true;
+}
+
+int main(int argc, char **argv) {
     openlog(NULL, SYSLOG_OPTIONS, LOG_LOCAL0);
 
+    unsigned int global_request_limit = ESP_REQUEST_GLOBAL_LIMIT_DEFAULT;
+    unsigned int port_request_limit = ESP_REQUEST_PORT_LIMIT_DEFAULT;
+    const char *group_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "bc:g:p:r")) != -1) {
+        switch (opt) {
+            case 'b':
+                set_esp_preferred_codec(ESP_CODEC_BINARY);
+                break;
+            case 'c':
+                group_file = optarg;
+                break;
+            case 'g':
+                if (!parse_request_limit(optarg, &global_request_limit)) {
+                    goto usage;
+                }
+                break;
+            case 'p':
+                if (!parse_request_limit(optarg, &port_request_limit)) {
+                    goto usage;
+                }
+                break;
+            case 'r':
+                set_esp_device_reset_on_recovery(true);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    set_esp_request_limits(global_request_limit, port_request_limit);
+    if (group_file != NULL) {
+        enum EspGroupResult group_result = load_esp_groups(group_file);
+        if (group_result != ESP_GROUP_RESULT_OK) {
+            syslog(LOG_ERR, "Failed to load groups from %s: %s", group_file, EspGroupResult_str[group_result]);
+        }
+    }
+
     switch (ubus_init(&g_ubus_context)) {
         case UBUS_RESULT_ERROR_CONNECTION_FAILED:
             syslog(LOG_ERR, "Failed to connect to ubus.");
@@ -21,8 +89,13 @@ int main(void) {
             syslog(LOG_INFO, "Esp communication daemon started successfully.");
             break;
     }
+    init_esp_trace_signal(SIGUSR1);
     uloop_run();
     ubus_deinit(g_ubus_context);
 
     return 0;
+
+usage:
+    fprintf(stderr, USAGE_FORMAT, argv[0]);
+    return 1;
 }
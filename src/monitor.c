@@ -0,0 +1,470 @@
+#include "monitor.h"
+#include "device.h"
+#include "queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libubox/avl-cmp.h>
+#include <libubox/utils.h>
+
+#define ESP_MONITOR_NOTIFY_TYPE "sensor"
+
+enum EspMonitorEvent {
+    ESP_MONITOR_EVENT_NONE,
+    ESP_MONITOR_EVENT_INITIAL,
+    ESP_MONITOR_EVENT_THRESHOLD,
+    ESP_MONITOR_EVENT_DELTA,
+    ESP_MONITOR_EVENT_HEARTBEAT,
+};
+
+static const char *EspMonitorEvent_str[] = {
+    "none",
+    "initial",
+    "threshold",
+    "delta",
+    "heartbeat",
+};
+
+static AVL_TREE(g_esp_monitors, avl_strcmp, false, NULL);
+static AVL_TREE(g_esp_monitor_streams, avl_strcmp, false, NULL);
+static struct EspMonitorStats g_stats;
+static struct ubus_context *g_ubus_context;
+static struct ubus_object *g_ubus_object;
+
+static bool
+format_esp_monitor_key(char *key, const char *port_name, int pin, const char *sensor, const char *field) {
+    int len = snprintf(key, ESP_MONITOR_KEY_SIZE, "%s:%d:%s:%s", port_name, pin, sensor, field);
+    return len > 0 && len < ESP_MONITOR_KEY_SIZE;
+}
+
+static bool
+format_esp_monitor_stream_key(char *key, const char *port_name, int pin, const char *sensor) {
+    int len = snprintf(key, ESP_MONITOR_KEY_SIZE, "%s:%d:%s", port_name, pin, sensor);
+    return len > 0 && len < ESP_MONITOR_KEY_SIZE;
+}
+
+static struct EspMonitor *
+find_esp_monitor(const char *key) {
+    struct EspMonitor *monitor;
+    return avl_find_element(&g_esp_monitors, key, monitor, node);
+}
+
+static struct EspMonitorStream *
+find_esp_monitor_stream(const char *key) {
+    struct EspMonitorStream *stream;
+    return avl_find_element(&g_esp_monitor_streams, key, stream, node);
+}
+
+// The reading reaches the monitors through the sensor reading callback like the
+// one of any other get.
+static void
+esp_monitor_poll_done(void *ctx, struct EspActionResult *result) {
+    struct EspMonitorStream *stream = ctx;
+    EspActionResult_free(result);
+
+    stream->polling = false;
+    // The last monitor went away while the poll was queued.
+    if (list_empty(&stream->monitors)) {
+        free(stream);
+    }
+}
+
+// Polls go through the queue of the port like any other request. An ESP which
+// has not answered the last poll yet is not asked again.
+static void
+poll_timeout_cb(struct uloop_timeout *timeout) {
+    struct EspMonitorStream *stream = container_of(timeout, struct EspMonitorStream, poll_timeout);
+    uloop_timeout_set(&stream->poll_timeout, stream->interval_ms);
+    if (stream->polling) {
+        return;
+    }
+
+    struct EspDevice *device;
+    if (lookup_esp_device(stream->action.port_name, &device) != USB_RESULT_OK) {
+        return;
+    }
+    if (enqueue_esp_action(device, &stream->action, 0, esp_monitor_poll_done, stream) == ADMISSION_RESULT_OK) {
+        stream->polling = true;
+    }
+}
+
+static struct EspMonitorStream *
+EspMonitorStream_new(const char *key, const struct EspMonitorConfig *config) {
+    char *stream_key, *port_name, *sensor, *model;
+    struct EspMonitorStream *stream = calloc_a(
+        sizeof(struct EspMonitorStream),
+        &stream_key, strlen(key) + 1,
+        &port_name, strlen(config->port_name) + 1,
+        &sensor, strlen(config->sensor) + 1,
+        &model, strlen(config->model) + 1
+    );
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    stream->key = strcpy(stream_key, key);
+    stream->action = (struct EspAction) {
+        .action_type = ESP_ACTION_GET_SENSOR,
+        .port_name = strcpy(port_name, config->port_name),
+        .pin = config->pin,
+        .sensor = strcpy(sensor, config->sensor),
+        .model = strcpy(model, config->model),
+    };
+    INIT_LIST_HEAD(&stream->monitors);
+    stream->poll_timeout.cb = poll_timeout_cb;
+    stream->node.key = stream->key;
+    avl_insert(&g_esp_monitor_streams, &stream->node);
+
+    return stream;
+}
+
+static void
+EspMonitorStream_free(struct EspMonitorStream *stream) {
+    uloop_timeout_cancel(&stream->poll_timeout);
+    avl_delete(&g_esp_monitor_streams, &stream->node);
+    // Otherwise esp_monitor_poll_done frees it.
+    if (!stream->polling) {
+        free(stream);
+    }
+}
+
+// Restarts polling at the shortest interval of the monitors left.
+static void
+update_esp_monitor_stream_interval(struct EspMonitorStream *stream) {
+    unsigned int interval_ms = 0;
+    struct EspMonitor *monitor;
+    list_for_each_entry(monitor, &stream->monitors, stream_list) {
+        unsigned int monitor_interval_ms = monitor->config.interval_ms;
+        if (monitor_interval_ms > 0 && (interval_ms == 0 || monitor_interval_ms < interval_ms)) {
+            interval_ms = monitor_interval_ms;
+        }
+    }
+
+    if (interval_ms == stream->interval_ms) {
+        return;
+    }
+    stream->interval_ms = interval_ms;
+    if (interval_ms > 0) {
+        uloop_timeout_set(&stream->poll_timeout, interval_ms);
+    } else {
+        uloop_timeout_cancel(&stream->poll_timeout);
+    }
+}
+
+static void
+EspMonitor_free(struct EspMonitor *monitor) {
+    struct EspMonitorStream *stream = monitor->stream;
+    uloop_timeout_cancel(&monitor->heartbeat_timeout);
+    list_del(&monitor->stream_list);
+    avl_delete(&g_esp_monitors, &monitor->node);
+    free(monitor);
+
+    if (list_empty(&stream->monitors)) {
+        EspMonitorStream_free(stream);
+    } else {
+        update_esp_monitor_stream_interval(stream);
+    }
+}
+
+// Runs for every sample of every monitored field, so it only compares numbers.
+// Heartbeats come from heartbeat_timeout_cb, readings or not.
+static enum EspMonitorEvent
+evaluate_esp_monitor(struct EspMonitor *monitor, double value) {
+    const struct EspMonitorConfig *config = &monitor->config;
+    if (!monitor->has_value) {
+        monitor->above_threshold = config->has_threshold && value > config->threshold;
+        return ESP_MONITOR_EVENT_INITIAL;
+    }
+
+    if (config->has_threshold) {
+        bool above_threshold = monitor->above_threshold
+            ? value >= config->threshold - config->hysteresis
+            : value > config->threshold + config->hysteresis;
+        if (above_threshold != monitor->above_threshold) {
+            monitor->above_threshold = above_threshold;
+            return ESP_MONITOR_EVENT_THRESHOLD;
+        }
+    }
+
+    double delta = value > monitor->value ? value - monitor->value : monitor->value - value;
+    if (config->min_delta > 0 && delta >= config->min_delta) {
+        return ESP_MONITOR_EVENT_DELTA;
+    }
+
+    return ESP_MONITOR_EVENT_NONE;
+}
+
+// Returns false if nobody is subscribed to hear it.
+static bool
+notify_esp_monitor(const struct EspMonitor *monitor, enum EspMonitorEvent event) {
+    if (g_ubus_context == NULL || !g_ubus_object->has_subscribers) {
+        return false;
+    }
+
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    blobmsg_add_string(&blob_buf, "port", monitor->config.port_name);
+    blobmsg_add_u32(&blob_buf, "pin", monitor->config.pin);
+    blobmsg_add_string(&blob_buf, "sensor", monitor->config.sensor);
+    blobmsg_add_string(&blob_buf, "field", monitor->config.field);
+    blobmsg_add_double(&blob_buf, "value", monitor->value);
+    blobmsg_add_string(&blob_buf, "reason", EspMonitorEvent_str[event]);
+    ubus_notify(g_ubus_context, g_ubus_object, ESP_MONITOR_NOTIFY_TYPE, blob_buf.head, -1);
+    blob_buf_free(&blob_buf);
+
+    return true;
+}
+
+// The value counts as reported whether anybody heard it or not, so deltas and
+// heartbeats do not depend on subscribers.
+static void
+emit_esp_monitor(struct EspMonitor *monitor, enum EspMonitorEvent event) {
+    monitor->has_value = true;
+    monitor->value = monitor->sample;
+    if (monitor->config.heartbeat_ms > 0) {
+        uloop_timeout_set(&monitor->heartbeat_timeout, monitor->config.heartbeat_ms);
+    }
+
+    if (notify_esp_monitor(monitor, event)) {
+        monitor->stats.emitted++;
+        g_stats.emitted++;
+    } else {
+        monitor->stats.unsent++;
+        g_stats.unsent++;
+    }
+}
+
+static void
+heartbeat_timeout_cb(struct uloop_timeout *timeout) {
+    struct EspMonitor *monitor = container_of(timeout, struct EspMonitor, heartbeat_timeout);
+    emit_esp_monitor(monitor, ESP_MONITOR_EVENT_HEARTBEAT);
+}
+
+static void
+update_esp_monitor(struct EspMonitor *monitor, double value) {
+    monitor->stats.samples++;
+    g_stats.samples++;
+    monitor->sample = value;
+
+    enum EspMonitorEvent event = evaluate_esp_monitor(monitor, value);
+    if (event == ESP_MONITOR_EVENT_NONE) {
+        monitor->stats.suppressed++;
+        g_stats.suppressed++;
+        return;
+    }
+
+    emit_esp_monitor(monitor, event);
+}
+
+static void
+process_esp_sensor_reading(const struct EspAction *action, const struct EspActionResult *result) {
+    if (avl_is_empty(&g_esp_monitors) || action->sensor == NULL) {
+        return;
+    }
+
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    esp_codec_decode_response(
+        result->codec,
+        result->esp_response_string,
+        result->esp_response_length,
+        &blob_buf
+    );
+    struct blob_attr *tb[__ESP_RESPONSE_MAX];
+    blobmsg_parse(
+        esp_response_policy,
+        __ESP_RESPONSE_MAX,
+        tb,
+        blob_data(blob_buf.head),
+        blob_len(blob_buf.head)
+    );
+    if (tb[ESP_RESPONSE_RC] == NULL || blobmsg_get_u32(tb[ESP_RESPONSE_RC]) != 0 || tb[ESP_RESPONSE_DATA] == NULL) {
+        goto end;
+    }
+
+    char key[ESP_MONITOR_KEY_SIZE];
+    struct blob_attr *field;
+    int rem;
+    blobmsg_for_each_attr(field, tb[ESP_RESPONSE_DATA], rem) {
+        double value;
+        if (!get_blobmsg_number(field, &value)) {
+            continue;
+        }
+        if (!format_esp_monitor_key(key, action->port_name, action->pin, action->sensor, blobmsg_name(field))) {
+            continue;
+        }
+        struct EspMonitor *monitor = find_esp_monitor(key);
+        if (monitor != NULL) {
+            update_esp_monitor(monitor, value);
+        }
+    }
+
+end:
+    blob_buf_free(&blob_buf);
+}
+
+void
+init_esp_monitors(struct ubus_context *ctx, struct ubus_object *object) {
+    g_ubus_context = ctx;
+    g_ubus_object = object;
+    set_esp_sensor_reading_cb(process_esp_sensor_reading);
+}
+
+enum EspMonitorResult
+set_esp_monitor(const struct EspMonitorConfig *config) {
+    if (config->port_name == NULL || config->sensor == NULL || config->model == NULL || config->field == NULL) {
+        return ESP_MONITOR_RESULT_ERR_INVALID;
+    }
+    if (config->hysteresis < 0 || config->min_delta < 0) {
+        return ESP_MONITOR_RESULT_ERR_INVALID;
+    }
+    char key[ESP_MONITOR_KEY_SIZE];
+    if (!format_esp_monitor_key(key, config->port_name, config->pin, config->sensor, config->field)) {
+        return ESP_MONITOR_RESULT_ERR_INVALID;
+    }
+
+    char stream_key[ESP_MONITOR_KEY_SIZE];
+    format_esp_monitor_stream_key(stream_key, config->port_name, config->pin, config->sensor);
+
+    // The model goes out with the poll, which is shared by every field.
+    struct EspMonitor *old_monitor = find_esp_monitor(key);
+    struct EspMonitorStream *stream = find_esp_monitor_stream(stream_key);
+    if (stream != NULL && strcmp(stream->action.model, config->model) != 0) {
+        struct EspMonitor *other;
+        list_for_each_entry(other, &stream->monitors, stream_list) {
+            if (other != old_monitor) {
+                return ESP_MONITOR_RESULT_ERR_INVALID;
+            }
+        }
+    }
+
+    char *monitor_key, *port_name, *sensor, *model, *field;
+    struct EspMonitor *monitor = calloc_a(
+        sizeof(struct EspMonitor),
+        &monitor_key, strlen(key) + 1,
+        &port_name, strlen(config->port_name) + 1,
+        &sensor, strlen(config->sensor) + 1,
+        &model, strlen(config->model) + 1,
+        &field, strlen(config->field) + 1
+    );
+    if (monitor == NULL) {
+        return ESP_MONITOR_RESULT_ERR_MEMORY;
+    }
+
+    monitor->key = strcpy(monitor_key, key);
+    monitor->config = *config;
+    monitor->config.port_name = strcpy(port_name, config->port_name);
+    monitor->config.sensor = strcpy(sensor, config->sensor);
+    monitor->config.model = strcpy(model, config->model);
+    monitor->config.field = strcpy(field, config->field);
+    monitor->heartbeat_timeout.cb = heartbeat_timeout_cb;
+
+    if (old_monitor != NULL) {
+        EspMonitor_free(old_monitor);
+    }
+    stream = find_esp_monitor_stream(stream_key);
+    if (stream == NULL) {
+        stream = EspMonitorStream_new(stream_key, config);
+    }
+    if (stream == NULL) {
+        free(monitor);
+        return ESP_MONITOR_RESULT_ERR_MEMORY;
+    }
+
+    monitor->stream = stream;
+    list_add_tail(&monitor->stream_list, &stream->monitors);
+    monitor->node.key = monitor->key;
+    avl_insert(&g_esp_monitors, &monitor->node);
+    update_esp_monitor_stream_interval(stream);
+
+    return ESP_MONITOR_RESULT_OK;
+}
+
+enum EspMonitorResult
+delete_esp_monitor(const char *port_name, int pin, const char *sensor, const char *field) {
+    char key[ESP_MONITOR_KEY_SIZE];
+    if (!format_esp_monitor_key(key, port_name, pin, sensor, field)) {
+        return ESP_MONITOR_RESULT_ERR_NOT_FOUND;
+    }
+    struct EspMonitor *monitor = find_esp_monitor(key);
+    if (monitor == NULL) {
+        return ESP_MONITOR_RESULT_ERR_NOT_FOUND;
+    }
+
+    EspMonitor_free(monitor);
+
+    return ESP_MONITOR_RESULT_OK;
+}
+
+bool
+get_blobmsg_number(struct blob_attr *attr, double *value) {
+    switch (blobmsg_type(attr)) {
+        case BLOBMSG_TYPE_DOUBLE:
+            *value = blobmsg_get_double(attr);
+            return true;
+        case BLOBMSG_TYPE_INT64:
+            *value = (int64_t) blobmsg_get_u64(attr);
+            return true;
+        case BLOBMSG_TYPE_INT32:
+            *value = (int32_t) blobmsg_get_u32(attr);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+add_esp_monitor_stats(struct blob_buf *result_blob_buf, const struct EspMonitorStats *stats) {
+    blobmsg_add_u64(result_blob_buf, "samples", stats->samples);
+    blobmsg_add_u64(result_blob_buf, "emitted", stats->emitted);
+    blobmsg_add_u64(result_blob_buf, "suppressed", stats->suppressed);
+    blobmsg_add_u64(result_blob_buf, "unsent", stats->unsent);
+}
+
+struct blob_buf *
+create_esp_monitors_message(struct blob_buf *result_blob_buf) {
+    add_esp_monitor_stats(result_blob_buf, &g_stats);
+
+    void *monitors_array = blobmsg_open_array(result_blob_buf, "monitors");
+    struct EspMonitor *monitor;
+    avl_for_each_element(&g_esp_monitors, monitor, node) {
+        const struct EspMonitorConfig *config = &monitor->config;
+        void *monitor_table = blobmsg_open_table(result_blob_buf, NULL);
+        blobmsg_add_string(result_blob_buf, "port", config->port_name);
+        blobmsg_add_u32(result_blob_buf, "pin", config->pin);
+        blobmsg_add_string(result_blob_buf, "sensor", config->sensor);
+        blobmsg_add_string(result_blob_buf, "model", config->model);
+        blobmsg_add_string(result_blob_buf, "field", config->field);
+        if (config->has_threshold) {
+            blobmsg_add_double(result_blob_buf, "threshold", config->threshold);
+            blobmsg_add_double(result_blob_buf, "hysteresis", config->hysteresis);
+        }
+        blobmsg_add_double(result_blob_buf, "delta", config->min_delta);
+        blobmsg_add_u32(result_blob_buf, "heartbeat", config->heartbeat_ms);
+        blobmsg_add_u32(result_blob_buf, "interval", config->interval_ms);
+        if (monitor->has_value) {
+            blobmsg_add_double(result_blob_buf, "value", monitor->value);
+        }
+        add_esp_monitor_stats(result_blob_buf, &monitor->stats);
+        blobmsg_close_table(result_blob_buf, monitor_table);
+    }
+    blobmsg_close_array(result_blob_buf, monitors_array);
+
+    return result_blob_buf;
+}
+
+void
+free_esp_monitors(void) {
+    struct EspMonitor *monitor, *tmp;
+    avl_for_each_element_safe(&g_esp_monitors, monitor, node, tmp) {
+        EspMonitor_free(monitor);
+    }
+    set_esp_sensor_reading_cb(NULL);
+}
+
+const char *EspMonitorResult_str[] = {
+    "Success.",
+    "Monitor definition is invalid.",
+    "Monitor does not exist.",
+    "Out of memory.",
+};
@@ -0,0 +1,98 @@
+#pragma once
+#include "esp.h"
+#include <libubox/avl.h>
+#include <libubox/list.h>
+#include <libubox/uloop.h>
+#include <libubus.h>
+
+// Longest "port:pin:sensor:field" a monitor can be keyed by, streams leave out the field.
+#define ESP_MONITOR_KEY_SIZE 256
+
+struct EspMonitorStats {
+    unsigned long samples;
+    unsigned long emitted;
+    unsigned long suppressed;
+    // Events nobody was subscribed to, not counted as emitted.
+    unsigned long unsent;
+};
+
+struct EspMonitorConfig {
+    const char *port_name;
+    int pin;
+    const char *sensor;
+    const char *model;
+    // Numeric field of the sensor data, e.g. "temperature".
+    const char *field;
+
+    bool has_threshold;
+    double threshold;
+    // Distance from the threshold a reading has to cross back over.
+    double hysteresis;
+    // 0 disables the respective condition.
+    double min_delta;
+    // Repeats the latest reading when nothing was reported for this long.
+    unsigned int heartbeat_ms;
+    // Polls the sensor on its own, 0 leaves the readings to get calls.
+    unsigned int interval_ms;
+};
+
+// Readings of one {port, pin, sensor}, polled once for all monitors of its fields.
+struct EspMonitorStream {
+    struct avl_node node;
+    char *key;
+    struct EspAction action;
+    struct list_head monitors;
+    // Shortest interval of its monitors, 0 if none of them polls.
+    unsigned int interval_ms;
+    struct uloop_timeout poll_timeout;
+    bool polling;
+};
+
+// Reports a numeric sensor field when it changes enough instead of every sample.
+struct EspMonitor {
+    struct avl_node node;
+    char *key;
+    struct EspMonitorConfig config;
+    struct EspMonitorStream *stream;
+    struct list_head stream_list;
+
+    bool has_value;
+    // Last emitted value, deltas are measured against it.
+    double value;
+    // Latest reading, which heartbeats report.
+    double sample;
+    bool above_threshold;
+    struct uloop_timeout heartbeat_timeout;
+    struct EspMonitorStats stats;
+};
+
+enum EspMonitorResult {
+    ESP_MONITOR_RESULT_OK,
+    ESP_MONITOR_RESULT_ERR_INVALID,
+    ESP_MONITOR_RESULT_ERR_NOT_FOUND,
+    ESP_MONITOR_RESULT_ERR_MEMORY,
+};
+
+extern const char *EspMonitorResult_str[];
+
+// Events are sent as "sensor" notifications of object.
+void
+init_esp_monitors(struct ubus_context *ctx, struct ubus_object *object);
+
+// Replaces any monitor of the same stream and field, starting it afresh. All
+// monitors of a stream have to use the same sensor model.
+enum EspMonitorResult
+set_esp_monitor(const struct EspMonitorConfig *config);
+
+enum EspMonitorResult
+delete_esp_monitor(const char *port_name, int pin, const char *sensor, const char *field);
+
+// Accepts any integer or double attribute.
+bool
+get_blobmsg_number(struct blob_attr *attr, double *value);
+
+struct blob_buf *
+create_esp_monitors_message(struct blob_buf *result_blob_buf);
+
+void
+free_esp_monitors(void);
@@ -0,0 +1,380 @@
+#include "queue.h"
+#include "device.h"
+#include "clock.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libubox/utils.h>
+
+struct EspRequest {
+    struct list_head list;
+    struct EspAction action;
+    // 0 if the caller did not ask for one.
+    long deadline_ms;
+
+    // Requests of the daemon report to done, those of ubus callers are replied to.
+    esp_request_done_t done;
+    void *done_ctx;
+    struct ubus_context *ctx;
+    struct ubus_request_data req;
+};
+
+static unsigned int g_global_limit = ESP_REQUEST_GLOBAL_LIMIT_DEFAULT;
+static unsigned int g_port_limit = ESP_REQUEST_PORT_LIMIT_DEFAULT;
+static struct AdmissionStats g_stats;
+
+static struct EspRequest *
+EspRequest_new(const struct EspAction *action, unsigned int timeout_ms) {
+    // The ubus message is gone once the handler returns, so the strings of the
+    // action are copied along.
+    char *port_name, *sensor, *model;
+    struct EspRequest *request = calloc_a(
+        sizeof(struct EspRequest),
+        &port_name, strlen(action->port_name) + 1,
+        &sensor, action->sensor != NULL ? strlen(action->sensor) + 1 : 0,
+        &model, action->model != NULL ? strlen(action->model) + 1 : 0
+    );
+    if (request == NULL) {
+        return NULL;
+    }
+
+    request->action = *action;
+    request->action.port_name = strcpy(port_name, action->port_name);
+    request->action.sensor = action->sensor != NULL ? strcpy(sensor, action->sensor) : NULL;
+    request->action.model = action->model != NULL ? strcpy(model, action->model) : NULL;
+    request->deadline_ms = timeout_ms > 0 ? monotonic_ms() + timeout_ms : 0;
+
+    return request;
+}
+
+static void
+remove_esp_request(struct EspRequestQueue *queue, struct EspRequest *request) {
+    list_del(&request->list);
+    queue->stats.outstanding--;
+    g_stats.outstanding--;
+    free(request);
+}
+
+// Takes over result.
+static void
+complete_esp_request(struct EspRequestQueue *queue, struct EspRequest *request, struct EspActionResult *result) {
+    if (request->done != NULL) {
+        request->done(request->done_ctx, result);
+    } else {
+        struct blob_buf blob_buf = {};
+        blob_buf_init(&blob_buf, 0);
+        create_esp_action_result_message(&blob_buf, request->action.action_type, *result);
+        ubus_send_reply(request->ctx, &request->req, blob_buf.head);
+        ubus_complete_deferred_request(request->ctx, &request->req, UBUS_STATUS_OK);
+        blob_buf_free(&blob_buf);
+        EspActionResult_free(result);
+    }
+    remove_esp_request(queue, request);
+}
+
+static void
+complete_esp_request_with(struct EspRequestQueue *queue, struct EspRequest *request, enum UsbResult usb_result) {
+    struct EspActionResult result = {
+        .usb_result = usb_result,
+        .esp_response_string = NULL,
+        .esp_response_length = 0,
+        .codec = ESP_CODEC_JSON,
+    };
+    complete_esp_request(queue, request, &result);
+}
+
+static void
+expire_esp_request(struct EspRequestQueue *queue, struct EspRequest *request) {
+    queue->stats.expired++;
+    g_stats.expired++;
+    if (request->done != NULL) {
+        complete_esp_request_with(queue, request, USB_RESULT_ERR_DEADLINE);
+        return;
+    }
+
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    blobmsg_add_string(&blob_buf, "result", "err");
+    blobmsg_add_string(&blob_buf, "message", "Request deadline passed before it was sent.");
+    ubus_send_reply(request->ctx, &request->req, blob_buf.head);
+    ubus_complete_deferred_request(request->ctx, &request->req, UBUS_STATUS_OK);
+    blob_buf_free(&blob_buf);
+    remove_esp_request(queue, request);
+}
+
+static void
+run_esp_request_done(struct EspActionRun *run) {
+    struct EspRequestQueue *queue = container_of(run, struct EspRequestQueue, run);
+    struct EspRequest *request = list_first_entry(&queue->requests, struct EspRequest, list);
+
+    queue->running = false;
+    queue->stats.completed++;
+    g_stats.completed++;
+    complete_esp_request(queue, request, &run->result);
+
+    if (!list_empty(&queue->requests)) {
+        uloop_timeout_set(&queue->drain_timeout, 0);
+    }
+}
+
+// Starts the request at the head of the queue. Returns false if it is already
+// over, it has been completed then.
+static bool
+start_esp_request(struct EspRequestQueue *queue, struct EspRequest *request) {
+    struct EspDevice *device = container_of(queue, struct EspDevice, queue);
+
+    // Only requests of the daemon are cut short once they have been sent, ubus
+    // callers' timeouts only cover the wait in the queue.
+    long deadline_ms = request->done != NULL && request->deadline_ms != 0 ? request->deadline_ms : LONG_MAX;
+    queue->run.done = run_esp_request_done;
+    if (start_esp_action_run(&queue->run, device, &request->action, deadline_ms) == USB_RESULT_OK) {
+        queue->running = true;
+        return true;
+    }
+
+    queue->stats.completed++;
+    g_stats.completed++;
+    complete_esp_request(queue, request, &queue->run.result);
+    return false;
+}
+
+static bool
+is_esp_request_waiting(struct EspRequestQueue *queue, struct EspRequest *request) {
+    return !queue->running || request != list_first_entry(&queue->requests, struct EspRequest, list);
+}
+
+static void
+schedule_esp_request_expiry(struct EspRequestQueue *queue) {
+    long deadline_ms = 0;
+    struct EspRequest *request;
+    list_for_each_entry(request, &queue->requests, list) {
+        if (request->deadline_ms != 0
+            && is_esp_request_waiting(queue, request)
+            && (deadline_ms == 0 || request->deadline_ms < deadline_ms)) {
+            deadline_ms = request->deadline_ms;
+        }
+    }
+
+    if (deadline_ms == 0) {
+        uloop_timeout_cancel(&queue->expire_timeout);
+        return;
+    }
+    long remaining = deadline_ms - monotonic_ms();
+    uloop_timeout_set(&queue->expire_timeout, remaining > 0 ? remaining : 0);
+}
+
+// Drops requests whose deadline passed while others were in flight, so that they
+// are answered on time and stop counting against the limits.
+static void
+expire_timeout_cb(struct uloop_timeout *timeout) {
+    struct EspRequestQueue *queue = container_of(timeout, struct EspRequestQueue, expire_timeout);
+    long now = monotonic_ms();
+    struct EspRequest *request, *tmp;
+    list_for_each_entry_safe(request, tmp, &queue->requests, list) {
+        if (request->deadline_ms != 0
+            && request->deadline_ms <= now
+            && is_esp_request_waiting(queue, request)) {
+            expire_esp_request(queue, request);
+        }
+    }
+
+    schedule_esp_request_expiry(queue);
+}
+
+// Starts at most one action per call, so that the ubus socket is served while it
+// is in flight and excess requests are turned away while they wait.
+static void
+drain_timeout_cb(struct uloop_timeout *timeout) {
+    struct EspRequestQueue *queue = container_of(timeout, struct EspRequestQueue, drain_timeout);
+    if (queue->running) {
+        return;
+    }
+
+    long now = monotonic_ms();
+    while (!list_empty(&queue->requests)) {
+        struct EspRequest *request = list_first_entry(&queue->requests, struct EspRequest, list);
+        if (request->deadline_ms != 0 && request->deadline_ms <= now) {
+            expire_esp_request(queue, request);
+            continue;
+        }
+
+        if (start_esp_request(queue, request)) {
+            return;
+        }
+        break;
+    }
+
+    if (!list_empty(&queue->requests)) {
+        uloop_timeout_set(&queue->drain_timeout, 0);
+    }
+}
+
+void
+EspRequestQueue_init(struct EspRequestQueue *queue) {
+    *queue = (struct EspRequestQueue) {};
+    INIT_LIST_HEAD(&queue->requests);
+    queue->drain_timeout.cb = drain_timeout_cb;
+    queue->expire_timeout.cb = expire_timeout_cb;
+}
+
+void
+EspRequestQueue_free(struct EspRequestQueue *queue, enum UsbResult usb_result) {
+    uloop_timeout_cancel(&queue->drain_timeout);
+    uloop_timeout_cancel(&queue->expire_timeout);
+    cancel_esp_action_run(&queue->run);
+    queue->running = false;
+
+    struct EspRequest *request, *tmp;
+    list_for_each_entry_safe(request, tmp, &queue->requests, list) {
+        complete_esp_request_with(queue, request, usb_result);
+    }
+}
+
+void
+set_esp_request_limits(unsigned int global_limit, unsigned int port_limit) {
+    g_global_limit = global_limit;
+    g_port_limit = port_limit;
+}
+
+static void
+stats_enter(struct AdmissionStats *stats) {
+    stats->admitted++;
+    stats->outstanding++;
+    if (stats->outstanding > stats->peak_outstanding) {
+        stats->peak_outstanding = stats->outstanding;
+    }
+}
+
+static bool
+admit_esp_request(struct EspRequestQueue *queue) {
+    if ((g_global_limit != 0 && g_stats.outstanding >= g_global_limit)
+        || (g_port_limit != 0 && queue->stats.outstanding >= g_port_limit)) {
+        queue->stats.rejected_busy++;
+        g_stats.rejected_busy++;
+        return false;
+    }
+    return true;
+}
+
+static void
+add_esp_request(struct EspRequestQueue *queue, struct EspRequest *request) {
+    list_add_tail(&request->list, &queue->requests);
+    stats_enter(&queue->stats);
+    stats_enter(&g_stats);
+
+    if (!queue->running && !queue->drain_timeout.pending) {
+        uloop_timeout_set(&queue->drain_timeout, 0);
+    }
+    if (request->deadline_ms != 0) {
+        schedule_esp_request_expiry(queue);
+    }
+}
+
+enum AdmissionResult
+enqueue_esp_request(
+    struct ubus_context *ctx,
+    struct ubus_request_data *req,
+    struct EspDevice *device,
+    const struct EspAction *action,
+    unsigned int timeout_ms)
+{
+    if (!admit_esp_request(&device->queue)) {
+        return ADMISSION_RESULT_BUSY;
+    }
+
+    struct EspRequest *request = EspRequest_new(action, timeout_ms);
+    if (request == NULL) {
+        return ADMISSION_RESULT_ERR;
+    }
+    request->ctx = ctx;
+    ubus_defer_request(ctx, req, &request->req);
+    add_esp_request(&device->queue, request);
+
+    return ADMISSION_RESULT_OK;
+}
+
+enum AdmissionResult
+enqueue_esp_action(
+    struct EspDevice *device,
+    const struct EspAction *action,
+    unsigned int timeout_ms,
+    esp_request_done_t done,
+    void *ctx)
+{
+    if (!admit_esp_request(&device->queue)) {
+        return ADMISSION_RESULT_BUSY;
+    }
+
+    struct EspRequest *request = EspRequest_new(action, timeout_ms);
+    if (request == NULL) {
+        return ADMISSION_RESULT_ERR;
+    }
+    request->done = done;
+    request->done_ctx = ctx;
+    add_esp_request(&device->queue, request);
+
+    return ADMISSION_RESULT_OK;
+}
+
+void
+cancel_esp_action(struct EspDevice *device, void *ctx) {
+    struct EspRequestQueue *queue = &device->queue;
+    struct EspRequest *request, *tmp;
+    list_for_each_entry_safe(request, tmp, &queue->requests, list) {
+        if (request->done == NULL || request->done_ctx != ctx) {
+            continue;
+        }
+        if (!is_esp_request_waiting(queue, request)) {
+            cancel_esp_action_run(&queue->run);
+            queue->running = false;
+        }
+        queue->stats.expired++;
+        g_stats.expired++;
+        remove_esp_request(queue, request);
+    }
+
+    if (!queue->running && !list_empty(&queue->requests) && !queue->drain_timeout.pending) {
+        uloop_timeout_set(&queue->drain_timeout, 0);
+    }
+}
+
+struct blob_buf *
+create_busy_result_message(struct blob_buf *result_blob_buf) {
+    blobmsg_add_string(result_blob_buf, "result", "busy");
+    blobmsg_add_string(result_blob_buf, "message", "Too many outstanding requests.");
+    return result_blob_buf;
+}
+
+static void
+add_admission_stats(struct blob_buf *blob_buf, const struct AdmissionStats *stats) {
+    blobmsg_add_u32(blob_buf, "outstanding", stats->outstanding);
+    blobmsg_add_u32(blob_buf, "peak_outstanding", stats->peak_outstanding);
+    blobmsg_add_u64(blob_buf, "admitted", stats->admitted);
+    blobmsg_add_u64(blob_buf, "rejected_busy", stats->rejected_busy);
+    blobmsg_add_u64(blob_buf, "expired", stats->expired);
+    blobmsg_add_u64(blob_buf, "completed", stats->completed);
+}
+
+static void
+add_port_admission_stats(struct EspDevice *device, void *blob_buf) {
+    void *port_table = blobmsg_open_table(blob_buf, NULL);
+    blobmsg_add_string(blob_buf, "port", device->port_name);
+    add_admission_stats(blob_buf, &device->queue.stats);
+    blobmsg_close_table(blob_buf, port_table);
+}
+
+struct blob_buf *
+create_admission_stats_message(struct blob_buf *result_blob_buf) {
+    void *limits_table = blobmsg_open_table(result_blob_buf, "limits");
+    blobmsg_add_u32(result_blob_buf, "global", g_global_limit);
+    blobmsg_add_u32(result_blob_buf, "port", g_port_limit);
+    blobmsg_close_table(result_blob_buf, limits_table);
+
+    add_admission_stats(result_blob_buf, &g_stats);
+
+    void *ports_array = blobmsg_open_array(result_blob_buf, "ports");
+    for_each_esp_device(add_port_admission_stats, result_blob_buf);
+    blobmsg_close_array(result_blob_buf, ports_array);
+
+    return result_blob_buf;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include "esp.h"
+#include <libubus.h>
+
+#define ESP_REQUEST_GLOBAL_LIMIT_DEFAULT 32
+#define ESP_REQUEST_PORT_LIMIT_DEFAULT 8
+
+struct EspDevice;
+
+struct AdmissionStats {
+    unsigned int outstanding;
+    unsigned int peak_outstanding;
+    unsigned long admitted;
+    unsigned long rejected_busy;
+    unsigned long expired;
+    unsigned long completed;
+};
+
+// Requests waiting for a single port, sent one at a time from uloop.
+struct EspRequestQueue {
+    struct list_head requests;
+    struct uloop_timeout drain_timeout;
+    // Armed at the earliest deadline of the requests still waiting.
+    struct uloop_timeout expire_timeout;
+    // Runs the request at the head of the list while it is in flight.
+    struct EspActionRun run;
+    bool running;
+    struct AdmissionStats stats;
+};
+
+enum AdmissionResult {
+    ADMISSION_RESULT_OK,
+    ADMISSION_RESULT_BUSY,
+    ADMISSION_RESULT_ERR,
+};
+
+void
+EspRequestQueue_init(struct EspRequestQueue *queue);
+
+// Completes every queued request with usb_result.
+void
+EspRequestQueue_free(struct EspRequestQueue *queue, enum UsbResult usb_result);
+
+// 0 disables the respective limit.
+void
+set_esp_request_limits(unsigned int global_limit, unsigned int port_limit);
+
+// On ADMISSION_RESULT_OK req has been deferred and will be replied to once the
+// action ran, or once timeout_ms passed without it being sent. 0 means no deadline.
+enum AdmissionResult
+enqueue_esp_request(
+    struct ubus_context *ctx,
+    struct ubus_request_data *req,
+    struct EspDevice *device,
+    const struct EspAction *action,
+    unsigned int timeout_ms
+);
+
+// Told about a request of enqueue_esp_action once it is over, result is handed
+// over to be freed with EspActionResult_free.
+typedef void (*esp_request_done_t)(void *ctx, struct EspActionResult *result);
+
+// Like enqueue_esp_request for requests of the daemon itself. timeout_ms bounds
+// the whole request, sent or not, which then ends with USB_RESULT_ERR_DEADLINE.
+// On ADMISSION_RESULT_OK done is called from uloop, never from within this call.
+enum AdmissionResult
+enqueue_esp_action(
+    struct EspDevice *device,
+    const struct EspAction *action,
+    unsigned int timeout_ms,
+    esp_request_done_t done,
+    void *ctx
+);
+
+// Drops the requests of enqueue_esp_action on device which were given ctx,
+// stopping one in flight, without calling done. They count as expired.
+void
+cancel_esp_action(struct EspDevice *device, void *ctx);
+
+struct blob_buf *
+create_busy_result_message(struct blob_buf *result_blob_buf);
+
+struct blob_buf *
+create_admission_stats_message(struct blob_buf *result_blob_buf);
@@ -1,10 +1,16 @@
 #include "serial.h"
+#include "clock.h"
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <libubox/blobmsg.h>
 
 #define ESP_VID 0x10c4
 #define ESP_PID 0xea60
+#define ESP_WRITE_TIMEOUT_MS 1000
+#define ESP_READ_TIMEOUT_MS 1500
 
 enum CheckEspPortResult {
     ESP_RESULT_OK_IS_ESP,
@@ -144,6 +150,41 @@ failure:
     return result;
 }
 
+// USB devices are named <bus>-<port>[.<port>...], interfaces append ":<config>.<interface>".
+static bool
+is_usb_device_name(const char *name) {
+    const char *dash = strchr(name, '-');
+    if (dash == NULL || dash == name || dash[1] == '\0') {
+        return false;
+    }
+    return strspn(name, "0123456789") == (size_t) (dash - name)
+        && strspn(dash + 1, "0123456789.") == strlen(dash + 1);
+}
+
+char *
+get_esp_port_usb_path(const char *port_name) {
+    const char *port_basename = strrchr(port_name, '/');
+    port_basename = port_basename != NULL ? port_basename + 1 : port_name;
+
+    char sysfs_path[PATH_MAX];
+    char device_path[PATH_MAX];
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/class/tty/%s/device", port_basename);
+    if (realpath(sysfs_path, device_path) == NULL) {
+        return NULL;
+    }
+
+    // The tty hangs off an interface of the USB device, the innermost device
+    // component of the path is the one it is plugged into.
+    const char *usb_path = NULL;
+    for (char *component = strtok(device_path, "/"); component != NULL; component = strtok(NULL, "/")) {
+        if (is_usb_device_name(component)) {
+            usb_path = component;
+        }
+    }
+
+    return usb_path != NULL ? strdup(usb_path) : NULL;
+}
+
 enum UsbResult
 open_port(struct sp_port *port) {
     if (sp_open(port, SP_MODE_READ_WRITE) != SP_OK) {
@@ -166,22 +207,190 @@ open_port(struct sp_port *port) {
     return USB_RESULT_OK;
 }
 
+static void
+finish_exchange(
+    struct SerialExchange *exchange,
+    struct SerialExchangeState *state,
+    enum UsbResult usb_result)
+{
+    exchange->usb_result = usb_result;
+    state->done = true;
+    finish_esp_trace_record(&state->trace, exchange->response_buf, exchange->response_len, usb_result);
+}
+
+// Ends an exchange whose time ran out, with whatever it received so far. Running
+// into the caller's deadline says nothing about the ESP, so it is not reported
+// as a read or write failure.
+static void
+expire_exchange(struct SerialExchange *exchange, struct SerialExchangeState *state, bool caller_deadline) {
+    if (exchange->response_len <= 0 && caller_deadline) {
+        finish_exchange(exchange, state, USB_RESULT_ERR_DEADLINE);
+    } else if (state->written < exchange->write_bytes) {
+        finish_exchange(exchange, state, USB_RESULT_ERR_PORT_WRITE);
+    } else if (exchange->response_len <= 0) {
+        finish_exchange(exchange, state, USB_RESULT_ERR_PORT_READ);
+    } else {
+        finish_exchange(exchange, state, USB_RESULT_OK);
+    }
+}
+
+static void
+write_exchange(struct SerialExchange *exchange, struct SerialExchangeState *state) {
+    int ret = sp_nonblocking_write(
+        exchange->port,
+        exchange->input_buf + state->written,
+        exchange->write_bytes - state->written
+    );
+    if (ret < 0) {
+        finish_exchange(exchange, state, USB_RESULT_ERR_PORT_WRITE);
+        return;
+    }
+    state->written += ret;
+    if (state->written == exchange->write_bytes) {
+        state->trace.write_end_us = monotonic_us();
+        state->read_deadline = monotonic_ms() + ESP_READ_TIMEOUT_MS;
+    }
+}
+
+static void
+read_exchange(struct SerialExchange *exchange, struct SerialExchangeState *state) {
+    int ret = sp_nonblocking_read(
+        exchange->port,
+        exchange->response_buf + exchange->response_len,
+        exchange->read_bytes - exchange->response_len
+    );
+    if (ret < 0) {
+        expire_exchange(exchange, state, false);
+        return;
+    }
+    if (ret == 0) {
+        return;
+    }
+
+    state->trace.read_last_us = monotonic_us();
+    if (exchange->response_len == 0) {
+        state->trace.read_first_us = state->trace.read_last_us;
+    }
+    exchange->response_len += ret;
+
+    bool complete = exchange->response_len >= exchange->read_bytes;
+    if (exchange->response_length != NULL) {
+        int expected = exchange->response_length(exchange->response_buf, exchange->response_len);
+        complete = complete || (expected > 0 && exchange->response_len >= expected);
+    }
+    if (complete) {
+        finish_exchange(exchange, state, USB_RESULT_OK);
+    }
+}
+
+static bool
+transfer_writing(const struct SerialTransfer *transfer) {
+    return transfer->state.written < transfer->exchange.write_bytes;
+}
+
+// Waits for the current direction until the exchange or the caller runs out of time.
+static void
+arm_serial_transfer(struct SerialTransfer *transfer) {
+    bool writing = transfer_writing(transfer);
+    long deadline = writing ? transfer->state.write_deadline : transfer->state.read_deadline;
+    if (transfer->deadline_ms < deadline) {
+        deadline = transfer->deadline_ms;
+    }
+    long remaining = deadline - monotonic_ms();
+
+    uloop_fd_add(&transfer->fd, writing ? ULOOP_WRITE : ULOOP_READ);
+    uloop_timeout_set(&transfer->timeout, remaining > 0 ? remaining : 0);
+}
+
+static void
+end_serial_transfer(struct SerialTransfer *transfer) {
+    uloop_fd_delete(&transfer->fd);
+    uloop_timeout_cancel(&transfer->timeout);
+    transfer->done(transfer);
+}
+
+static void
+serial_transfer_fd_cb(struct uloop_fd *fd, unsigned int events) {
+    struct SerialTransfer *transfer = container_of(fd, struct SerialTransfer, fd);
+    if (fd->error || fd->eof) {
+        expire_exchange(&transfer->exchange, &transfer->state, false);
+    } else if (transfer_writing(transfer)) {
+        write_exchange(&transfer->exchange, &transfer->state);
+        if (!transfer->state.done && !transfer_writing(transfer)) {
+            arm_serial_transfer(transfer);
+        }
+    } else {
+        read_exchange(&transfer->exchange, &transfer->state);
+    }
+
+    if (transfer->state.done) {
+        end_serial_transfer(transfer);
+    }
+}
+
+static void
+serial_transfer_timeout_cb(struct uloop_timeout *timeout) {
+    struct SerialTransfer *transfer = container_of(timeout, struct SerialTransfer, timeout);
+    long exchange_deadline = transfer_writing(transfer)
+        ? transfer->state.write_deadline
+        : transfer->state.read_deadline;
+
+    expire_exchange(&transfer->exchange, &transfer->state, transfer->deadline_ms < exchange_deadline);
+    end_serial_transfer(transfer);
+}
+
+enum UsbResult
+start_serial_transfer(struct SerialTransfer *transfer, long deadline_ms) {
+    struct SerialExchange *exchange = &transfer->exchange;
+    transfer->state = (struct SerialExchangeState) {};
+    transfer->deadline_ms = deadline_ms;
+    exchange->response_len = 0;
+    if (sp_get_port_handle(exchange->port, &transfer->state.fd) != SP_OK) {
+        exchange->usb_result = USB_RESULT_ERR_UNKNOWN;
+        return exchange->usb_result;
+    }
+
+    start_esp_trace_record(
+        &transfer->state.trace,
+        sp_get_port_name(exchange->port),
+        exchange->input_buf,
+        exchange->write_bytes
+    );
+    transfer->state.write_deadline = monotonic_ms() + ESP_WRITE_TIMEOUT_MS;
+    transfer->fd = (struct uloop_fd) {.cb = serial_transfer_fd_cb, .fd = transfer->state.fd};
+    transfer->timeout = (struct uloop_timeout) {.cb = serial_transfer_timeout_cb};
+    arm_serial_transfer(transfer);
+
+    return USB_RESULT_OK;
+}
+
+void
+cancel_serial_transfer(struct SerialTransfer *transfer) {
+    // The timeout is armed for as long as the transfer runs.
+    if (!transfer->timeout.pending) {
+        return;
+    }
+    uloop_fd_delete(&transfer->fd);
+    uloop_timeout_cancel(&transfer->timeout);
+    expire_exchange(&transfer->exchange, &transfer->state, true);
+}
+
 enum UsbResult
-write_and_await_response(
-    struct sp_port *port,
-    const char *input_buf,
-    int write_bytes,
-    char *response_buf,
-    int read_bytes
-) {
-    int ret = sp_blocking_write(port, input_buf, write_bytes, 1000);
-    if (ret != write_bytes) {
-        return USB_RESULT_ERR_PORT_WRITE;
+assert_esp_reset(struct sp_port *port) {
+    if (sp_set_dtr(port, SP_DTR_OFF) != SP_OK) {
+        return USB_RESULT_ERR_UNKNOWN;
+    }
+    if (sp_set_rts(port, SP_RTS_ON) != SP_OK) {
+        return USB_RESULT_ERR_UNKNOWN;
     }
 
-    ret = sp_blocking_read(port, response_buf, read_bytes, 1500);
-    if (ret <= 0) {
-        return USB_RESULT_ERR_PORT_READ;
+    return USB_RESULT_OK;
+}
+
+enum UsbResult
+release_esp_reset(struct sp_port *port) {
+    if (sp_set_rts(port, SP_RTS_OFF) != SP_OK) {
+        return USB_RESULT_ERR_UNKNOWN;
     }
 
     return USB_RESULT_OK;
@@ -194,5 +403,7 @@ const char *UsbResult_str[] = {
     "Failed to write to port.",
     "Port does not exist.",
     "Port is not connected to an ESP.",
+    "Port is unavailable, ESP stopped responding.",
+    "Deadline passed before the ESP answered.",
     "Unknown failure."
 };
@@ -1,5 +1,11 @@
 #pragma once
+#include "trace.h"
+#include <stdbool.h>
 #include <libserialport.h>
+#include <libubox/uloop.h>
+
+// How long EN is held low to reset the ESP.
+#define ESP_RESET_PULSE_MS 100
 
 enum UsbResult {
     USB_RESULT_OK,
@@ -8,6 +14,8 @@ enum UsbResult {
     USB_RESULT_ERR_PORT_WRITE,
     USB_RESULT_ERR_PORT_NOT_FOUND,
     USB_RESULT_ERR_PORT_INVALID,
+    USB_RESULT_ERR_PORT_UNAVAILABLE,
+    USB_RESULT_ERR_DEADLINE,
     USB_RESULT_ERR_UNKNOWN,
 };
 
@@ -19,14 +27,73 @@ enumerate_esp_serial_ports(struct sp_port ***port_list);
 enum UsbResult
 get_esp_port_by_name(const char *port_name, struct sp_port **port);
 
+// Physical USB port the ESP is plugged into, e.g. "1-1.2", read from sysfs.
+// Returns NULL if it cannot be told, the result has to be freed by the caller.
+char *
+get_esp_port_usb_path(const char *port_name);
+
+// Returns the total length of the response starting at buf once enough of it has
+// been read to tell, 0 otherwise.
+typedef int (*response_length_t)(const char *buf, int len);
+
+// One request/response exchange of a SerialTransfer. usb_result and response_len
+// are filled in once it is over.
+struct SerialExchange {
+    struct sp_port *port;
+    const char *input_buf;
+    int write_bytes;
+    char *response_buf;
+    int read_bytes;
+    response_length_t response_length;
+
+    int response_len;
+    enum UsbResult usb_result;
+};
+
+// Progress of an exchange, only touched by serial.c.
+struct SerialExchangeState {
+    // Copied into the trace ring once the exchange is over.
+    struct EspTraceRecord trace;
+    int fd;
+    int written;
+    long write_deadline;
+    long read_deadline;
+    bool done;
+};
+
+struct SerialTransfer;
+
+typedef void (*serial_transfer_done_t)(struct SerialTransfer *transfer);
+
+// Exchange driven by uloop instead of blocking the caller.
+struct SerialTransfer {
+    struct SerialExchange exchange;
+    serial_transfer_done_t done;
+
+    struct SerialExchangeState state;
+    long deadline_ms;
+    struct uloop_fd fd;
+    struct uloop_timeout timeout;
+};
+
+// Starts the exchange on an open port and returns right away. done is called from
+// uloop once the response is complete, read_bytes have been read or the ESP
+// timed out, or at deadline_ms on the monotonic clock. If it could not be started the error is
+// returned and done is never called.
 enum UsbResult
-write_and_await_response(
-    struct sp_port *port,
-    const char *input_buf,
-    int write_bytes,
-    char *response_buf, int read_bytes
-);
+start_serial_transfer(struct SerialTransfer *transfer, long deadline_ms);
+
+// Stops a running transfer without calling done.
+void
+cancel_serial_transfer(struct SerialTransfer *transfer);
 
 enum UsbResult
 open_port(struct sp_port *port);
 
+// Pulls EN low through RTS, the ESP boots once release_esp_reset is called
+// ESP_RESET_PULSE_MS later.
+enum UsbResult
+assert_esp_reset(struct sp_port *port);
+
+enum UsbResult
+release_esp_reset(struct sp_port *port);
@@ -0,0 +1,247 @@
+#include "trace.h"
+#include "serial.h"
+#include "clock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libubox/uloop.h>
+
+#define ESP_TRACE_RECORD_COUNT 64
+#define ESP_TRACE_MAGIC "ESPTRACE"
+#define ESP_TRACE_VERSION 1
+
+struct EspTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t record_count;
+};
+
+static struct EspTraceRecord g_trace[ESP_TRACE_RECORD_COUNT];
+static unsigned long g_trace_total = 0;
+
+static int g_signal_pipe[2] = {-1, -1};
+static struct uloop_fd g_signal_fd;
+
+void
+start_esp_trace_record(
+    struct EspTraceRecord *record,
+    const char *port_name,
+    const char *written,
+    int written_len)
+{
+    int captured = written_len < ESP_TRACE_DATA_SIZE ? written_len : ESP_TRACE_DATA_SIZE;
+    record->write_start_us = monotonic_us();
+    record->write_end_us = 0;
+    record->read_first_us = 0;
+    record->read_last_us = 0;
+    record->usb_result = USB_RESULT_OK;
+    record->written_len = written_len;
+    record->read_len = 0;
+    strncpy(record->port_name, port_name, ESP_TRACE_PORT_NAME_SIZE - 1);
+    record->port_name[ESP_TRACE_PORT_NAME_SIZE - 1] = '\0';
+    memcpy(record->written, written, captured);
+}
+
+void
+finish_esp_trace_record(
+    struct EspTraceRecord *record,
+    const char *read,
+    int read_len,
+    uint32_t usb_result)
+{
+    int captured = read_len < ESP_TRACE_DATA_SIZE ? read_len : ESP_TRACE_DATA_SIZE;
+    record->usb_result = usb_result;
+    record->read_len = read_len;
+    memcpy(record->read, read, captured);
+
+    g_trace[g_trace_total % ESP_TRACE_RECORD_COUNT] = *record;
+    g_trace_total++;
+}
+
+const struct EspTraceRecord *
+last_esp_trace_record(void) {
+    if (g_trace_total == 0) {
+        return NULL;
+    }
+    return &g_trace[(g_trace_total - 1) % ESP_TRACE_RECORD_COUNT];
+}
+
+static bool
+write_all(int fd, const void *buf, size_t len) {
+    const char *pos = buf;
+    while (len > 0) {
+        ssize_t ret = write(fd, pos, len);
+        if (ret <= 0) {
+            return false;
+        }
+        pos += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+// Refuses the directory unless it is a real one only the daemon can write to, /var
+// may well be a symlink to /tmp.
+static int
+open_esp_trace_dir(void) {
+    if (mkdir(ESP_TRACE_DIR, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    int dir_fd = open(ESP_TRACE_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return -1;
+    }
+
+    struct stat dir_stat;
+    if (fstat(dir_fd, &dir_stat) != 0
+        || dir_stat.st_uid != geteuid()
+        || (dir_stat.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        close(dir_fd);
+        return -1;
+    }
+    return dir_fd;
+}
+
+static bool
+is_esp_trace_name(const char *name) {
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL && strlen(name) < NAME_MAX - 5;
+}
+
+enum EspTraceResult
+dump_esp_trace(const char *name, int *record_count) {
+    if (!is_esp_trace_name(name)) {
+        return ESP_TRACE_RESULT_ERR_NAME;
+    }
+    int dir_fd = open_esp_trace_dir();
+    if (dir_fd < 0) {
+        return ESP_TRACE_RESULT_ERR_FILE;
+    }
+
+    // Written next to the target and renamed over it, a reader never sees half a
+    // trace and a symlink in place of the target is replaced instead of followed.
+    char tmp_name[NAME_MAX + 1];
+    snprintf(tmp_name, sizeof(tmp_name), ".%s.tmp", name);
+    unlinkat(dir_fd, tmp_name, 0);
+    int fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        close(dir_fd);
+        return ESP_TRACE_RESULT_ERR_FILE;
+    }
+
+    unsigned long count = g_trace_total < ESP_TRACE_RECORD_COUNT ? g_trace_total : ESP_TRACE_RECORD_COUNT;
+    struct EspTraceHeader header = {
+        .magic = ESP_TRACE_MAGIC,
+        .version = ESP_TRACE_VERSION,
+        .record_size = sizeof(struct EspTraceRecord),
+        .record_count = count,
+    };
+    bool success = write_all(fd, &header, sizeof(header));
+    for (unsigned long i = g_trace_total - count; success && i < g_trace_total; i++) {
+        success = write_all(fd, &g_trace[i % ESP_TRACE_RECORD_COUNT], sizeof(struct EspTraceRecord));
+    }
+    success = close(fd) == 0 && success;
+    success = success && renameat(dir_fd, tmp_name, dir_fd, name) == 0;
+    if (!success) {
+        unlinkat(dir_fd, tmp_name, 0);
+    }
+    close(dir_fd);
+
+    *record_count = count;
+    return success ? ESP_TRACE_RESULT_OK : ESP_TRACE_RESULT_ERR_FILE;
+}
+
+enum EspTraceResult
+load_esp_trace(const char *path, struct EspTraceRecord **records, int *record_count) {
+    enum EspTraceResult result = ESP_TRACE_RESULT_OK;
+    *records = NULL;
+    *record_count = 0;
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return ESP_TRACE_RESULT_ERR_FILE;
+    }
+
+    struct EspTraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, ESP_TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != ESP_TRACE_VERSION
+        || header.record_size != sizeof(struct EspTraceRecord)
+        || header.record_count > ESP_TRACE_RECORD_COUNT) {
+        result = ESP_TRACE_RESULT_ERR_FORMAT;
+        goto cleanup;
+    }
+    if (header.record_count == 0) {
+        goto cleanup;
+    }
+
+    *records = (struct EspTraceRecord *) calloc(header.record_count, sizeof(struct EspTraceRecord));
+    if (*records == NULL) {
+        result = ESP_TRACE_RESULT_ERR_MEMORY;
+        goto cleanup;
+    }
+    if (fread(*records, sizeof(struct EspTraceRecord), header.record_count, file) != header.record_count) {
+        free(*records);
+        *records = NULL;
+        result = ESP_TRACE_RESULT_ERR_FORMAT;
+        goto cleanup;
+    }
+    *record_count = header.record_count;
+
+cleanup:
+    fclose(file);
+    return result;
+}
+
+static void
+trace_signal_handler(int signum) {
+    // Only async signal safe work here, the dump itself runs from uloop.
+    char byte = 0;
+    ssize_t ret = write(g_signal_pipe[1], &byte, 1);
+    (void) ret;
+}
+
+static void
+trace_signal_fd_cb(struct uloop_fd *fd, unsigned int events) {
+    char buf[16];
+    while (read(fd->fd, buf, sizeof(buf)) > 0) {
+    }
+
+    int record_count = 0;
+    enum EspTraceResult result = dump_esp_trace(ESP_TRACE_DEFAULT_NAME, &record_count);
+    if (result != ESP_TRACE_RESULT_OK) {
+        syslog(LOG_ERR, "Failed to dump trace: %s", EspTraceResult_str[result]);
+        return;
+    }
+    syslog(LOG_INFO, "Dumped %d transactions to %s/%s.", record_count, ESP_TRACE_DIR, ESP_TRACE_DEFAULT_NAME);
+}
+
+void
+init_esp_trace_signal(int signum) {
+    if (pipe2(g_signal_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        syslog(LOG_ERR, "Failed to create trace signal pipe.");
+        return;
+    }
+
+    g_signal_fd = (struct uloop_fd) {.cb = trace_signal_fd_cb, .fd = g_signal_pipe[0]};
+    uloop_fd_add(&g_signal_fd, ULOOP_READ);
+
+    struct sigaction action = {.sa_handler = trace_signal_handler, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    sigaction(signum, &action, NULL);
+}
+
+const char *EspTraceResult_str[] = {
+    "Success.",
+    "Failed to access trace file.",
+    "Trace file name must not contain a slash or start with a dot.",
+    "Trace file is malformed.",
+    "Out of memory.",
+};
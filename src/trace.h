@@ -0,0 +1,73 @@
+#pragma once
+#include <stdint.h>
+
+#define ESP_TRACE_PORT_NAME_SIZE 32
+#define ESP_TRACE_DATA_SIZE 256
+// Traces are only written into this directory, which the daemon creates for itself.
+#define ESP_TRACE_DIR "/var/run/espcommd"
+#define ESP_TRACE_DEFAULT_NAME "espcommd.trace"
+
+// One serial transaction. Timestamps are CLOCK_MONOTONIC microseconds, the read
+// ones stay 0 if nothing was received. Only the first ESP_TRACE_DATA_SIZE bytes
+// of each direction are kept, the lengths are the full ones.
+struct EspTraceRecord {
+    uint64_t write_start_us;
+    uint64_t write_end_us;
+    uint64_t read_first_us;
+    uint64_t read_last_us;
+    uint32_t usb_result;
+    uint16_t written_len;
+    uint16_t read_len;
+    char port_name[ESP_TRACE_PORT_NAME_SIZE];
+    uint8_t written[ESP_TRACE_DATA_SIZE];
+    uint8_t read[ESP_TRACE_DATA_SIZE];
+};
+
+enum EspTraceResult {
+    ESP_TRACE_RESULT_OK,
+    ESP_TRACE_RESULT_ERR_FILE,
+    ESP_TRACE_RESULT_ERR_NAME,
+    ESP_TRACE_RESULT_ERR_FORMAT,
+    ESP_TRACE_RESULT_ERR_MEMORY,
+};
+
+extern const char *EspTraceResult_str[];
+
+// Fills in record for a transaction about to be written and stamps the write
+// start. The record stays with the caller while the transaction runs.
+void
+start_esp_trace_record(
+    struct EspTraceRecord *record,
+    const char *port_name,
+    const char *written,
+    int written_len
+);
+
+// Completes record with the response and usb_result, a UsbResult, and copies it
+// over the oldest slot of the ring buffer. Unfinished transactions never show
+// up in the ring.
+void
+finish_esp_trace_record(
+    struct EspTraceRecord *record,
+    const char *read,
+    int read_len,
+    uint32_t usb_result
+);
+
+// NULL before the first transaction finished.
+const struct EspTraceRecord *
+last_esp_trace_record(void);
+
+// Writes the ring buffer to name in ESP_TRACE_DIR, oldest transaction first. name
+// is a plain file name, it must not contain a slash or start with a dot.
+enum EspTraceResult
+dump_esp_trace(const char *name, int *record_count);
+
+// records has to be freed by the caller, it stays NULL for an empty trace. Traces
+// holding more records than the ring are rejected as malformed.
+enum EspTraceResult
+load_esp_trace(const char *path, struct EspTraceRecord **records, int *record_count);
+
+// Dumps the trace to ESP_TRACE_DEFAULT_NAME whenever signum arrives. Needs uloop.
+void
+init_esp_trace_signal(int signum);
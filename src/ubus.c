@@ -1,9 +1,26 @@
 #include "ubus.h"
 #include "serial.h"
 #include "esp.h"
+#include "device.h"
+#include "trace.h"
+#include "group.h"
+#include "monitor.h"
+#include "clock.h"
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <syslog.h>
 #include <libubox/blobmsg_json.h>
 
+#define ESP_UBUS_OBJECT_NAME "espcommd"
+#define ESP_HOTPLUG_SCAN_INTERVAL_MS 2000
+// Long enough for a JSON exchange to run into its own read timeout.
+#define ESP_GROUP_DEFAULT_TIMEOUT_MS 3000
+#define ESP_GROUP_MAX_TIMEOUT_MS 60000
+
+static struct ubus_context *g_ubus_context;
+
 static int
 devices_get(
     struct ubus_context *ctx,
@@ -13,6 +30,24 @@ devices_get(
     struct blob_attr *msg
 );
 
+static int
+admission_get(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
+static int
+trace_dump(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
 static int
 toggle_pin(
     struct ubus_context *ctx,
@@ -31,9 +66,100 @@ get_sensor(
     struct blob_attr *msg
 );
 
+static int
+groups_get(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
+static int
+group_set(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
+static int
+group_delete(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
+static int
+group_toggle_pin(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
+static int
+group_get_sensor(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
+static int
+monitors_get(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
+static int
+monitor_set(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
+static int
+monitor_delete(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
+static int
+device_toggle_pin(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
+static int
+device_get_sensor(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+);
+
 enum {
     ESP_UBUS_TOGGLE_PIN_POLICY_PORT,
     ESP_UBUS_TOGGLE_PIN_POLICY_PIN,
+    ESP_UBUS_TOGGLE_PIN_POLICY_TIMEOUT,
     __ESP_UBUS_TOGGLE_PIN_POLICY_MAX,
 };
 
@@ -42,13 +168,82 @@ enum {
     ESP_UBUS_GET_SENSOR_POLICY_PIN,
     ESP_UBUS_GET_SENSOR_POLICY_SENSOR,
     ESP_UBUS_GET_SENSOR_POLICY_SENSOR_MODEL,
+    ESP_UBUS_GET_SENSOR_POLICY_TIMEOUT,
     __ESP_UBUS_GET_SENSOR_POLICY_MAX,
 };
 
+enum {
+    ESP_UBUS_TRACE_POLICY_NAME,
+    __ESP_UBUS_TRACE_POLICY_MAX,
+};
+
+enum {
+    ESP_UBUS_GROUP_SET_POLICY_NAME,
+    ESP_UBUS_GROUP_SET_POLICY_MEMBERS,
+    __ESP_UBUS_GROUP_SET_POLICY_MAX,
+};
+
+enum {
+    ESP_UBUS_GROUP_DELETE_POLICY_NAME,
+    __ESP_UBUS_GROUP_DELETE_POLICY_MAX,
+};
+
+enum {
+    ESP_UBUS_GROUP_TOGGLE_PIN_POLICY_NAME,
+    ESP_UBUS_GROUP_TOGGLE_PIN_POLICY_TIMEOUT,
+    __ESP_UBUS_GROUP_TOGGLE_PIN_POLICY_MAX,
+};
+
+enum {
+    ESP_UBUS_GROUP_GET_SENSOR_POLICY_NAME,
+    ESP_UBUS_GROUP_GET_SENSOR_POLICY_SENSOR,
+    ESP_UBUS_GROUP_GET_SENSOR_POLICY_SENSOR_MODEL,
+    ESP_UBUS_GROUP_GET_SENSOR_POLICY_TIMEOUT,
+    __ESP_UBUS_GROUP_GET_SENSOR_POLICY_MAX,
+};
+
+enum {
+    ESP_UBUS_MONITOR_SET_POLICY_PORT,
+    ESP_UBUS_MONITOR_SET_POLICY_PIN,
+    ESP_UBUS_MONITOR_SET_POLICY_SENSOR,
+    ESP_UBUS_MONITOR_SET_POLICY_SENSOR_MODEL,
+    ESP_UBUS_MONITOR_SET_POLICY_FIELD,
+    ESP_UBUS_MONITOR_SET_POLICY_THRESHOLD,
+    ESP_UBUS_MONITOR_SET_POLICY_HYSTERESIS,
+    ESP_UBUS_MONITOR_SET_POLICY_DELTA,
+    ESP_UBUS_MONITOR_SET_POLICY_HEARTBEAT,
+    ESP_UBUS_MONITOR_SET_POLICY_INTERVAL,
+    __ESP_UBUS_MONITOR_SET_POLICY_MAX,
+};
+
+enum {
+    ESP_UBUS_MONITOR_DELETE_POLICY_PORT,
+    ESP_UBUS_MONITOR_DELETE_POLICY_PIN,
+    ESP_UBUS_MONITOR_DELETE_POLICY_SENSOR,
+    ESP_UBUS_MONITOR_DELETE_POLICY_FIELD,
+    __ESP_UBUS_MONITOR_DELETE_POLICY_MAX,
+};
+
+// Per device objects take the same arguments, minus the port.
+enum {
+    ESP_UBUS_DEVICE_TOGGLE_PIN_POLICY_PIN,
+    ESP_UBUS_DEVICE_TOGGLE_PIN_POLICY_TIMEOUT,
+    __ESP_UBUS_DEVICE_TOGGLE_PIN_POLICY_MAX,
+};
+
+enum {
+    ESP_UBUS_DEVICE_GET_SENSOR_POLICY_PIN,
+    ESP_UBUS_DEVICE_GET_SENSOR_POLICY_SENSOR,
+    ESP_UBUS_DEVICE_GET_SENSOR_POLICY_SENSOR_MODEL,
+    ESP_UBUS_DEVICE_GET_SENSOR_POLICY_TIMEOUT,
+    __ESP_UBUS_DEVICE_GET_SENSOR_POLICY_MAX,
+};
+
 static const struct blobmsg_policy
 esp_toggle_pin_policy[] = {
     [ESP_UBUS_TOGGLE_PIN_POLICY_PORT] = {.name = "port", .type = BLOBMSG_TYPE_STRING},
     [ESP_UBUS_TOGGLE_PIN_POLICY_PIN] = {.name = "pin", .type = BLOBMSG_TYPE_INT32},
+    [ESP_UBUS_TOGGLE_PIN_POLICY_TIMEOUT] = {.name = "timeout", .type = BLOBMSG_TYPE_INT32},
 };
 
 static const struct blobmsg_policy
@@ -57,22 +252,111 @@ esp_get_sensor_policy[] = {
     [ESP_UBUS_GET_SENSOR_POLICY_PIN] = {.name = "pin", .type = BLOBMSG_TYPE_INT32},
     [ESP_UBUS_GET_SENSOR_POLICY_SENSOR] = {.name = "sensor", .type = BLOBMSG_TYPE_STRING},
     [ESP_UBUS_GET_SENSOR_POLICY_SENSOR_MODEL] = {.name = "model", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_GET_SENSOR_POLICY_TIMEOUT] = {.name = "timeout", .type = BLOBMSG_TYPE_INT32},
+};
+
+static const struct blobmsg_policy
+esp_trace_policy[] = {
+    [ESP_UBUS_TRACE_POLICY_NAME] = {.name = "name", .type = BLOBMSG_TYPE_STRING},
+};
+
+static const struct blobmsg_policy
+esp_group_set_policy[] = {
+    [ESP_UBUS_GROUP_SET_POLICY_NAME] = {.name = "name", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_GROUP_SET_POLICY_MEMBERS] = {.name = "members", .type = BLOBMSG_TYPE_ARRAY},
+};
+
+static const struct blobmsg_policy
+esp_group_delete_policy[] = {
+    [ESP_UBUS_GROUP_DELETE_POLICY_NAME] = {.name = "name", .type = BLOBMSG_TYPE_STRING},
+};
+
+static const struct blobmsg_policy
+esp_group_toggle_pin_policy[] = {
+    [ESP_UBUS_GROUP_TOGGLE_PIN_POLICY_NAME] = {.name = "name", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_GROUP_TOGGLE_PIN_POLICY_TIMEOUT] = {.name = "timeout", .type = BLOBMSG_TYPE_INT32},
+};
+
+static const struct blobmsg_policy
+esp_group_get_sensor_policy[] = {
+    [ESP_UBUS_GROUP_GET_SENSOR_POLICY_NAME] = {.name = "name", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_GROUP_GET_SENSOR_POLICY_SENSOR] = {.name = "sensor", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_GROUP_GET_SENSOR_POLICY_SENSOR_MODEL] = {.name = "model", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_GROUP_GET_SENSOR_POLICY_TIMEOUT] = {.name = "timeout", .type = BLOBMSG_TYPE_INT32},
+};
+
+// Numbers are left unspecified, ubus call sends whole ones as integers.
+static const struct blobmsg_policy
+esp_monitor_set_policy[] = {
+    [ESP_UBUS_MONITOR_SET_POLICY_PORT] = {.name = "port", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_MONITOR_SET_POLICY_PIN] = {.name = "pin", .type = BLOBMSG_TYPE_INT32},
+    [ESP_UBUS_MONITOR_SET_POLICY_SENSOR] = {.name = "sensor", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_MONITOR_SET_POLICY_SENSOR_MODEL] = {.name = "model", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_MONITOR_SET_POLICY_FIELD] = {.name = "field", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_MONITOR_SET_POLICY_THRESHOLD] = {.name = "threshold", .type = BLOBMSG_TYPE_UNSPEC},
+    [ESP_UBUS_MONITOR_SET_POLICY_HYSTERESIS] = {.name = "hysteresis", .type = BLOBMSG_TYPE_UNSPEC},
+    [ESP_UBUS_MONITOR_SET_POLICY_DELTA] = {.name = "delta", .type = BLOBMSG_TYPE_UNSPEC},
+    [ESP_UBUS_MONITOR_SET_POLICY_HEARTBEAT] = {.name = "heartbeat", .type = BLOBMSG_TYPE_INT32},
+    [ESP_UBUS_MONITOR_SET_POLICY_INTERVAL] = {.name = "interval", .type = BLOBMSG_TYPE_INT32},
+};
+
+static const struct blobmsg_policy
+esp_monitor_delete_policy[] = {
+    [ESP_UBUS_MONITOR_DELETE_POLICY_PORT] = {.name = "port", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_MONITOR_DELETE_POLICY_PIN] = {.name = "pin", .type = BLOBMSG_TYPE_INT32},
+    [ESP_UBUS_MONITOR_DELETE_POLICY_SENSOR] = {.name = "sensor", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_MONITOR_DELETE_POLICY_FIELD] = {.name = "field", .type = BLOBMSG_TYPE_STRING},
+};
+
+static const struct blobmsg_policy
+esp_device_toggle_pin_policy[] = {
+    [ESP_UBUS_DEVICE_TOGGLE_PIN_POLICY_PIN] = {.name = "pin", .type = BLOBMSG_TYPE_INT32},
+    [ESP_UBUS_DEVICE_TOGGLE_PIN_POLICY_TIMEOUT] = {.name = "timeout", .type = BLOBMSG_TYPE_INT32},
+};
+
+static const struct blobmsg_policy
+esp_device_get_sensor_policy[] = {
+    [ESP_UBUS_DEVICE_GET_SENSOR_POLICY_PIN] = {.name = "pin", .type = BLOBMSG_TYPE_INT32},
+    [ESP_UBUS_DEVICE_GET_SENSOR_POLICY_SENSOR] = {.name = "sensor", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_DEVICE_GET_SENSOR_POLICY_SENSOR_MODEL] = {.name = "model", .type = BLOBMSG_TYPE_STRING},
+    [ESP_UBUS_DEVICE_GET_SENSOR_POLICY_TIMEOUT] = {.name = "timeout", .type = BLOBMSG_TYPE_INT32},
 };
 
 static struct ubus_method
 esp_methods[] = {
     UBUS_METHOD_NOARG("devices", devices_get),
+    UBUS_METHOD_NOARG("admission", admission_get),
+    UBUS_METHOD("trace", trace_dump, esp_trace_policy),
     UBUS_METHOD("on", toggle_pin, esp_toggle_pin_policy),
     UBUS_METHOD("off", toggle_pin, esp_toggle_pin_policy),
     UBUS_METHOD("get", get_sensor, esp_get_sensor_policy),
+    UBUS_METHOD_NOARG("groups", groups_get),
+    UBUS_METHOD("group_set", group_set, esp_group_set_policy),
+    UBUS_METHOD("group_delete", group_delete, esp_group_delete_policy),
+    UBUS_METHOD("group_on", group_toggle_pin, esp_group_toggle_pin_policy),
+    UBUS_METHOD("group_off", group_toggle_pin, esp_group_toggle_pin_policy),
+    UBUS_METHOD("group_get", group_get_sensor, esp_group_get_sensor_policy),
+    UBUS_METHOD_NOARG("monitors", monitors_get),
+    UBUS_METHOD("monitor_set", monitor_set, esp_monitor_set_policy),
+    UBUS_METHOD("monitor_delete", monitor_delete, esp_monitor_delete_policy),
 };
 
 static struct ubus_object_type
 esp_object_type = UBUS_OBJECT_TYPE("esp", esp_methods);
 
+static struct ubus_method
+esp_device_methods[] = {
+    UBUS_METHOD("on", device_toggle_pin, esp_device_toggle_pin_policy),
+    UBUS_METHOD("off", device_toggle_pin, esp_device_toggle_pin_policy),
+    UBUS_METHOD("get", device_get_sensor, esp_device_get_sensor_policy),
+};
+
+static struct ubus_object_type
+esp_device_object_type = UBUS_OBJECT_TYPE("esp-device", esp_device_methods);
+
 static struct ubus_object
 esp_object = {
-    .name = "espcommd",
+    .name = ESP_UBUS_OBJECT_NAME,
     .type = &esp_object_type,
     .methods = esp_methods,
     .n_methods = ARRAY_SIZE(esp_methods),
@@ -110,6 +394,25 @@ devices_get(
         blobmsg_add_string(&blob_buf, "vid", vid_pid_buf);
         snprintf(vid_pid_buf, sizeof(vid_pid_buf), "%x", pid);
         blobmsg_add_string(&blob_buf, "pid", vid_pid_buf);
+
+        // Ports which have not been used yet have a closed breaker by definition.
+        struct EspDevice *device = find_esp_device(sp_get_port_name(port));
+        enum CircuitBreakerState breaker_state = device != NULL ? device->breaker.state : CIRCUIT_BREAKER_CLOSED;
+        blobmsg_add_string(&blob_buf, "breaker", CircuitBreakerState_str[breaker_state]);
+        blobmsg_add_u32(&blob_buf, "failures", device != NULL ? device->breaker.consecutive_failures : 0);
+        enum EspCodec codec = device != NULL ? device->codec : ESP_CODEC_JSON;
+        blobmsg_add_string(&blob_buf, "codec", EspCodec_str[codec]);
+        if (device != NULL && device->object.object.id != 0) {
+            blobmsg_add_string(&blob_buf, "object", device->object.name);
+        }
+        if (device != NULL && device->serial_number != NULL) {
+            blobmsg_add_string(&blob_buf, "serial", device->serial_number);
+            // Set while the alias carries the USB path or has been withheld.
+            blobmsg_add_u8(&blob_buf, "serial_conflict", device->serial_conflict);
+        }
+        if (device != NULL && device->alias_object.object.id != 0) {
+            blobmsg_add_string(&blob_buf, "alias", device->alias_object.name);
+        }
         blobmsg_close_table(&blob_buf, device_table);
     }
     blobmsg_close_array(&blob_buf, devices_array);
@@ -122,6 +425,66 @@ devices_get(
     return UBUS_STATUS_OK;
 }
 
+static int
+admission_get(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    create_admission_stats_message(&blob_buf);
+    ubus_send_reply(ctx, req, blob_buf.head);
+    blob_buf_free(&blob_buf);
+
+    return UBUS_STATUS_OK;
+}
+
+static int
+trace_dump(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct blob_attr *tb[__ESP_UBUS_TRACE_POLICY_MAX];
+    blobmsg_parse(
+        esp_trace_policy,
+        __ESP_UBUS_TRACE_POLICY_MAX,
+        tb,
+        blob_data(msg),
+        blob_len(msg)
+    );
+    // Callers only pick the file name, the directory is fixed.
+    const char *name = tb[ESP_UBUS_TRACE_POLICY_NAME] != NULL
+        ? blobmsg_get_string(tb[ESP_UBUS_TRACE_POLICY_NAME])
+        : ESP_TRACE_DEFAULT_NAME;
+
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+
+    int record_count = 0;
+    enum EspTraceResult trace_result = dump_esp_trace(name, &record_count);
+    if (trace_result != ESP_TRACE_RESULT_OK) {
+        blobmsg_add_string(&blob_buf, "result", "err");
+        blobmsg_add_string(&blob_buf, "message", EspTraceResult_str[trace_result]);
+    } else {
+        blobmsg_add_string(&blob_buf, "result", "ok");
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", ESP_TRACE_DIR, name);
+        blobmsg_add_string(&blob_buf, "path", path);
+        blobmsg_add_u32(&blob_buf, "transactions", record_count);
+    }
+
+    ubus_send_reply(ctx, req, blob_buf.head);
+    blob_buf_free(&blob_buf);
+
+    return UBUS_STATUS_OK;
+}
+
 // Return 1 for "on", 0 for "off" and -1 if neither.
 void
 get_pin_target_state_from_ubus_method(int *pin_state, char *method) {
@@ -139,6 +502,74 @@ get_pin_target_state_from_ubus_method(int *pin_state, char *method) {
     return;
 }
 
+static void
+send_esp_action_reply(
+    struct ubus_context *ctx,
+    struct ubus_request_data *req,
+    enum EspActionType esp_action_type,
+    struct EspActionResult *result)
+{
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    create_esp_action_result_message(&blob_buf, esp_action_type, *result);
+    EspActionResult_free(result);
+
+    ubus_send_reply(ctx, req, blob_buf.head);
+    blob_buf_free(&blob_buf);
+}
+
+// Queues the action behind the device's other requests.
+static int
+submit_esp_action(
+    struct ubus_context *ctx,
+    struct ubus_request_data *req,
+    struct EspDevice *device,
+    struct EspAction *esp_action,
+    struct blob_attr *timeout_attr)
+{
+    unsigned int timeout_ms = timeout_attr != NULL ? blobmsg_get_u32(timeout_attr) : 0;
+    struct blob_buf blob_buf = {};
+    switch (enqueue_esp_request(ctx, req, device, esp_action, timeout_ms)) {
+        case ADMISSION_RESULT_OK:
+            break;
+        case ADMISSION_RESULT_BUSY:
+            blob_buf_init(&blob_buf, 0);
+            create_busy_result_message(&blob_buf);
+            ubus_send_reply(ctx, req, blob_buf.head);
+            blob_buf_free(&blob_buf);
+            break;
+        case ADMISSION_RESULT_ERR:
+            return UBUS_STATUS_UNKNOWN_ERROR;
+    }
+
+    return UBUS_STATUS_OK;
+}
+
+// Like submit_esp_action for a port given by name, which is checked for an ESP
+// the first time it is used.
+static int
+submit_esp_port_action(
+    struct ubus_context *ctx,
+    struct ubus_request_data *req,
+    struct EspAction *esp_action,
+    struct blob_attr *timeout_attr)
+{
+    struct EspDevice *device;
+    enum UsbResult usb_result = lookup_esp_device(esp_action->port_name, &device);
+    if (usb_result != USB_RESULT_OK) {
+        struct EspActionResult result = {
+            .usb_result = usb_result,
+            .esp_response_string = NULL,
+            .esp_response_length = 0,
+            .codec = ESP_CODEC_JSON,
+        };
+        send_esp_action_reply(ctx, req, esp_action->action_type, &result);
+        return UBUS_STATUS_OK;
+    }
+
+    return submit_esp_action(ctx, req, device, esp_action, timeout_attr);
+}
+
 static int
 toggle_pin(
     struct ubus_context *ctx,
@@ -165,9 +596,6 @@ toggle_pin(
     }
     int pin = blobmsg_get_u32(tb[ESP_UBUS_TOGGLE_PIN_POLICY_PIN]);
 
-    struct blob_buf blob_buf = {};
-    blob_buf_init(&blob_buf, 0);
-
     int pin_target_state = -1;
     get_pin_target_state_from_ubus_method(&pin_target_state, (char*) method);
     assert(pin_target_state != -1); // Ubus method, which called pin_toggle was not on or off.
@@ -179,14 +607,7 @@ toggle_pin(
         .pin = pin,
     };
 
-    struct EspActionResult result = execute_esp_action(esp_action);
-    create_esp_action_result_message(&blob_buf, esp_action.action_type, result);
-    EspActionResult_free(&result);
-
-    ubus_send_reply(ctx, req, blob_buf.head);
-    blob_buf_free(&blob_buf);
-        
-    return UBUS_STATUS_OK;
+    return submit_esp_port_action(ctx, req, &esp_action, tb[ESP_UBUS_TOGGLE_PIN_POLICY_TIMEOUT]);
 }
 
 static int
@@ -225,8 +646,6 @@ get_sensor(
     }
     char *model = blobmsg_get_string(tb[ESP_UBUS_GET_SENSOR_POLICY_SENSOR_MODEL]);
 
-    struct blob_buf blob_buf = {};
-    blob_buf_init(&blob_buf, 0);
     struct EspAction esp_action = {
         .action_type = ESP_ACTION_GET_SENSOR,
         .port_name = port_name,
@@ -234,34 +653,655 @@ get_sensor(
         .sensor = sensor,
         .model = model
     };
-    struct EspActionResult result = execute_esp_action(esp_action);
-    create_esp_action_result_message(&blob_buf, esp_action.action_type, result);
-    EspActionResult_free(&result);
+    return submit_esp_port_action(ctx, req, &esp_action, tb[ESP_UBUS_GET_SENSOR_POLICY_TIMEOUT]);
+}
 
+static int
+groups_get(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    create_esp_groups_message(&blob_buf);
     ubus_send_reply(ctx, req, blob_buf.head);
     blob_buf_free(&blob_buf);
 
     return UBUS_STATUS_OK;
 }
 
-enum UbusResult
-ubus_init(struct ubus_context **context) {
-    struct ubus_context *ctx = ubus_connect(NULL);
-    *context = ctx;
-    if (ctx == NULL) {
-        return UBUS_RESULT_ERROR_CONNECTION_FAILED;
-    }
-    uloop_init();
-    ubus_add_uloop(ctx);
-    if (ubus_add_object(ctx, &esp_object) != 0) {
-        return UBUS_RESULT_ERROR_INIT_FAILED;
-    }
+static void
+send_esp_group_result_reply(
+    struct ubus_context *ctx,
+    struct ubus_request_data *req,
+    enum EspGroupResult group_result)
+{
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    blobmsg_add_string(&blob_buf, "result", group_result == ESP_GROUP_RESULT_OK ? "ok" : "err");
+    blobmsg_add_string(&blob_buf, "message", EspGroupResult_str[group_result]);
+    ubus_send_reply(ctx, req, blob_buf.head);
+    blob_buf_free(&blob_buf);
+}
+
+static int
+group_set(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct blob_attr *tb[__ESP_UBUS_GROUP_SET_POLICY_MAX];
+    blobmsg_parse(
+        esp_group_set_policy,
+        __ESP_UBUS_GROUP_SET_POLICY_MAX,
+        tb,
+        blob_data(msg),
+        blob_len(msg)
+    );
+    if (tb[ESP_UBUS_GROUP_SET_POLICY_NAME] == NULL || tb[ESP_UBUS_GROUP_SET_POLICY_MEMBERS] == NULL) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+
+    enum EspGroupResult group_result = set_esp_group(
+        blobmsg_get_string(tb[ESP_UBUS_GROUP_SET_POLICY_NAME]),
+        tb[ESP_UBUS_GROUP_SET_POLICY_MEMBERS]
+    );
+    send_esp_group_result_reply(ctx, req, group_result);
+
+    return UBUS_STATUS_OK;
+}
+
+static int
+group_delete(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct blob_attr *tb[__ESP_UBUS_GROUP_DELETE_POLICY_MAX];
+    blobmsg_parse(
+        esp_group_delete_policy,
+        __ESP_UBUS_GROUP_DELETE_POLICY_MAX,
+        tb,
+        blob_data(msg),
+        blob_len(msg)
+    );
+    if (tb[ESP_UBUS_GROUP_DELETE_POLICY_NAME] == NULL) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+
+    enum EspGroupResult group_result = delete_esp_group(blobmsg_get_string(tb[ESP_UBUS_GROUP_DELETE_POLICY_NAME]));
+    send_esp_group_result_reply(ctx, req, group_result);
+
+    return UBUS_STATUS_OK;
+}
+
+struct EspGroupRequest;
+
+struct EspGroupMemberRequest {
+    struct EspGroupRequest *group_request;
+    char *port_name;
+    int pin;
+    bool busy;
+    // Set while the member is queued on device.
+    struct EspDevice *device;
+    struct EspActionResult result;
+};
+
+// Deferred group call, replied to once every member has its result or the
+// timeout passed, whichever comes first.
+struct EspGroupRequest {
+    struct ubus_context *ctx;
+    struct ubus_request_data req;
+    enum EspActionType action_type;
+    long start_ms;
+    struct uloop_timeout timeout;
+    int pending_count;
+    int member_count;
+    struct EspGroupMemberRequest members[];
+};
+
+static void
+EspGroupRequest_free(struct EspGroupRequest *group_request) {
+    for (int i = 0; i < group_request->member_count; i++) {
+        free(group_request->members[i].port_name);
+        EspActionResult_free(&group_request->members[i].result);
+    }
+    free(group_request);
+}
+
+static void
+complete_esp_group_request(struct EspGroupRequest *group_request) {
+    uloop_timeout_cancel(&group_request->timeout);
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    blobmsg_add_u32(&blob_buf, "elapsed_ms", monotonic_ms() - group_request->start_ms);
+    void *members_array = blobmsg_open_array(&blob_buf, "members");
+    for (int i = 0; i < group_request->member_count; i++) {
+        struct EspGroupMemberRequest *member = &group_request->members[i];
+        void *member_table = blobmsg_open_table(&blob_buf, NULL);
+        blobmsg_add_string(&blob_buf, "port", member->port_name);
+        blobmsg_add_u32(&blob_buf, "pin", member->pin);
+        if (member->busy) {
+            create_busy_result_message(&blob_buf);
+        } else {
+            create_esp_action_result_message(&blob_buf, group_request->action_type, member->result);
+        }
+        blobmsg_close_table(&blob_buf, member_table);
+    }
+    blobmsg_close_array(&blob_buf, members_array);
+
+    ubus_send_reply(group_request->ctx, &group_request->req, blob_buf.head);
+    ubus_complete_deferred_request(group_request->ctx, &group_request->req, UBUS_STATUS_OK);
+    blob_buf_free(&blob_buf);
+    EspGroupRequest_free(group_request);
+}
+
+static void
+esp_group_member_done(void *ctx, struct EspActionResult *result) {
+    struct EspGroupMemberRequest *member = ctx;
+    struct EspGroupRequest *group_request = member->group_request;
+    member->device = NULL;
+    member->result = *result;
+
+    if (--group_request->pending_count == 0) {
+        complete_esp_group_request(group_request);
+    }
+}
+
+// Members still queued behind other requests of their port or in flight are
+// dropped, so that the caller is answered at its deadline.
+static void
+esp_group_timeout_cb(struct uloop_timeout *timeout) {
+    struct EspGroupRequest *group_request = container_of(timeout, struct EspGroupRequest, timeout);
+    for (int i = 0; i < group_request->member_count; i++) {
+        struct EspGroupMemberRequest *member = &group_request->members[i];
+        if (member->device == NULL) {
+            continue;
+        }
+        cancel_esp_action(member->device, member);
+        member->device = NULL;
+        member->result.usb_result = USB_RESULT_ERR_DEADLINE;
+    }
+    complete_esp_group_request(group_request);
+}
+
+// Queues the action for every member behind the other requests of its port, so
+// members on different ports run at the same time and count against the same
+// limits as single requests. Replies with the result of each once all are over.
+static int
+execute_esp_group_action(
+    struct ubus_context *ctx,
+    struct ubus_request_data *req,
+    const struct EspGroup *group,
+    const struct EspAction *esp_action,
+    struct blob_attr *timeout_attr)
+{
+    unsigned int timeout_ms = timeout_attr != NULL
+        ? blobmsg_get_u32(timeout_attr)
+        : ESP_GROUP_DEFAULT_TIMEOUT_MS;
+    if (timeout_ms == 0 || timeout_ms > ESP_GROUP_MAX_TIMEOUT_MS) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+
+    struct EspGroupRequest *group_request = calloc(
+        1,
+        sizeof(struct EspGroupRequest) + group->member_count * sizeof(struct EspGroupMemberRequest)
+    );
+    if (group_request == NULL) {
+        return UBUS_STATUS_UNKNOWN_ERROR;
+    }
+    group_request->ctx = ctx;
+    group_request->action_type = esp_action->action_type;
+    group_request->start_ms = monotonic_ms();
+    group_request->timeout.cb = esp_group_timeout_cb;
+    group_request->member_count = group->member_count;
+    // The group may be changed or deleted before the members are done.
+    for (int i = 0; i < group->member_count; i++) {
+        struct EspGroupMemberRequest *member = &group_request->members[i];
+        member->group_request = group_request;
+        member->pin = group->members[i].pin;
+        member->port_name = strdup(group->members[i].port_name);
+        if (member->port_name == NULL) {
+            EspGroupRequest_free(group_request);
+            return UBUS_STATUS_UNKNOWN_ERROR;
+        }
+    }
+    ubus_defer_request(ctx, req, &group_request->req);
+
+    for (int i = 0; i < group_request->member_count; i++) {
+        struct EspGroupMemberRequest *member = &group_request->members[i];
+        struct EspDevice *device;
+        member->result.usb_result = lookup_esp_device(member->port_name, &device);
+        if (member->result.usb_result != USB_RESULT_OK) {
+            continue;
+        }
+
+        struct EspAction member_action = *esp_action;
+        member_action.port_name = member->port_name;
+        member_action.pin = member->pin;
+        switch (enqueue_esp_action(device, &member_action, timeout_ms, esp_group_member_done, member)) {
+            case ADMISSION_RESULT_OK:
+                member->device = device;
+                group_request->pending_count++;
+                break;
+            case ADMISSION_RESULT_BUSY:
+                member->busy = true;
+                break;
+            case ADMISSION_RESULT_ERR:
+                member->result.usb_result = USB_RESULT_ERR_UNKNOWN;
+                break;
+        }
+    }
+
+    if (group_request->pending_count == 0) {
+        complete_esp_group_request(group_request);
+    } else {
+        long remaining = group_request->start_ms + timeout_ms - monotonic_ms();
+        uloop_timeout_set(&group_request->timeout, remaining > 0 ? remaining : 0);
+    }
+
+    return UBUS_STATUS_OK;
+}
+
+static int
+group_toggle_pin(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct blob_attr *tb[__ESP_UBUS_GROUP_TOGGLE_PIN_POLICY_MAX];
+    blobmsg_parse(
+        esp_group_toggle_pin_policy,
+        __ESP_UBUS_GROUP_TOGGLE_PIN_POLICY_MAX,
+        tb,
+        blob_data(msg),
+        blob_len(msg)
+    );
+    if (tb[ESP_UBUS_GROUP_TOGGLE_PIN_POLICY_NAME] == NULL) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+    struct EspGroup *group = find_esp_group(blobmsg_get_string(tb[ESP_UBUS_GROUP_TOGGLE_PIN_POLICY_NAME]));
+    if (group == NULL) {
+        return UBUS_STATUS_NOT_FOUND;
+    }
+
+    // The group methods are named group_on and group_off.
+    int pin_target_state = -1;
+    get_pin_target_state_from_ubus_method(&pin_target_state, (char*) method + strlen("group_"));
+    assert(pin_target_state != -1);
+
+    struct EspAction esp_action = {
+        .action_type = pin_target_state == 1 ? ESP_ACTION_ON : ESP_ACTION_OFF,
+    };
+
+    return execute_esp_group_action(ctx, req, group, &esp_action, tb[ESP_UBUS_GROUP_TOGGLE_PIN_POLICY_TIMEOUT]);
+}
+
+static int
+group_get_sensor(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct blob_attr *tb[__ESP_UBUS_GROUP_GET_SENSOR_POLICY_MAX];
+    blobmsg_parse(
+        esp_group_get_sensor_policy,
+        __ESP_UBUS_GROUP_GET_SENSOR_POLICY_MAX,
+        tb,
+        blob_data(msg),
+        blob_len(msg)
+    );
+    if (tb[ESP_UBUS_GROUP_GET_SENSOR_POLICY_NAME] == NULL
+        || tb[ESP_UBUS_GROUP_GET_SENSOR_POLICY_SENSOR] == NULL
+        || tb[ESP_UBUS_GROUP_GET_SENSOR_POLICY_SENSOR_MODEL] == NULL) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+    struct EspGroup *group = find_esp_group(blobmsg_get_string(tb[ESP_UBUS_GROUP_GET_SENSOR_POLICY_NAME]));
+    if (group == NULL) {
+        return UBUS_STATUS_NOT_FOUND;
+    }
+
+    struct EspAction esp_action = {
+        .action_type = ESP_ACTION_GET_SENSOR,
+        .sensor = blobmsg_get_string(tb[ESP_UBUS_GROUP_GET_SENSOR_POLICY_SENSOR]),
+        .model = blobmsg_get_string(tb[ESP_UBUS_GROUP_GET_SENSOR_POLICY_SENSOR_MODEL]),
+    };
+
+    return execute_esp_group_action(ctx, req, group, &esp_action, tb[ESP_UBUS_GROUP_GET_SENSOR_POLICY_TIMEOUT]);
+}
+
+static int
+monitors_get(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    create_esp_monitors_message(&blob_buf);
+    ubus_send_reply(ctx, req, blob_buf.head);
+    blob_buf_free(&blob_buf);
+
+    return UBUS_STATUS_OK;
+}
+
+static void
+send_esp_monitor_result_reply(
+    struct ubus_context *ctx,
+    struct ubus_request_data *req,
+    enum EspMonitorResult monitor_result)
+{
+    struct blob_buf blob_buf = {};
+    blob_buf_init(&blob_buf, 0);
+    blobmsg_add_string(&blob_buf, "result", monitor_result == ESP_MONITOR_RESULT_OK ? "ok" : "err");
+    blobmsg_add_string(&blob_buf, "message", EspMonitorResult_str[monitor_result]);
+    ubus_send_reply(ctx, req, blob_buf.head);
+    blob_buf_free(&blob_buf);
+}
+
+// Absent numbers keep their default, anything that is not a number is rejected.
+static bool
+get_optional_number(struct blob_attr *attr, double *value) {
+    return attr == NULL || get_blobmsg_number(attr, value);
+}
+
+static int
+monitor_set(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct blob_attr *tb[__ESP_UBUS_MONITOR_SET_POLICY_MAX];
+    blobmsg_parse(
+        esp_monitor_set_policy,
+        __ESP_UBUS_MONITOR_SET_POLICY_MAX,
+        tb,
+        blob_data(msg),
+        blob_len(msg)
+    );
+    if (tb[ESP_UBUS_MONITOR_SET_POLICY_PORT] == NULL
+        || tb[ESP_UBUS_MONITOR_SET_POLICY_PIN] == NULL
+        || tb[ESP_UBUS_MONITOR_SET_POLICY_SENSOR] == NULL
+        || tb[ESP_UBUS_MONITOR_SET_POLICY_SENSOR_MODEL] == NULL
+        || tb[ESP_UBUS_MONITOR_SET_POLICY_FIELD] == NULL) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+
+    struct EspMonitorConfig config = {
+        .port_name = blobmsg_get_string(tb[ESP_UBUS_MONITOR_SET_POLICY_PORT]),
+        .pin = blobmsg_get_u32(tb[ESP_UBUS_MONITOR_SET_POLICY_PIN]),
+        .sensor = blobmsg_get_string(tb[ESP_UBUS_MONITOR_SET_POLICY_SENSOR]),
+        .model = blobmsg_get_string(tb[ESP_UBUS_MONITOR_SET_POLICY_SENSOR_MODEL]),
+        .field = blobmsg_get_string(tb[ESP_UBUS_MONITOR_SET_POLICY_FIELD]),
+        .has_threshold = tb[ESP_UBUS_MONITOR_SET_POLICY_THRESHOLD] != NULL,
+    };
+    if (!get_optional_number(tb[ESP_UBUS_MONITOR_SET_POLICY_THRESHOLD], &config.threshold)
+        || !get_optional_number(tb[ESP_UBUS_MONITOR_SET_POLICY_HYSTERESIS], &config.hysteresis)
+        || !get_optional_number(tb[ESP_UBUS_MONITOR_SET_POLICY_DELTA], &config.min_delta)) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+    if (tb[ESP_UBUS_MONITOR_SET_POLICY_HEARTBEAT] != NULL) {
+        config.heartbeat_ms = blobmsg_get_u32(tb[ESP_UBUS_MONITOR_SET_POLICY_HEARTBEAT]);
+    }
+    if (tb[ESP_UBUS_MONITOR_SET_POLICY_INTERVAL] != NULL) {
+        config.interval_ms = blobmsg_get_u32(tb[ESP_UBUS_MONITOR_SET_POLICY_INTERVAL]);
+    }
+
+    send_esp_monitor_result_reply(ctx, req, set_esp_monitor(&config));
+
+    return UBUS_STATUS_OK;
+}
+
+static int
+monitor_delete(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct blob_attr *tb[__ESP_UBUS_MONITOR_DELETE_POLICY_MAX];
+    blobmsg_parse(
+        esp_monitor_delete_policy,
+        __ESP_UBUS_MONITOR_DELETE_POLICY_MAX,
+        tb,
+        blob_data(msg),
+        blob_len(msg)
+    );
+    if (tb[ESP_UBUS_MONITOR_DELETE_POLICY_PORT] == NULL
+        || tb[ESP_UBUS_MONITOR_DELETE_POLICY_PIN] == NULL
+        || tb[ESP_UBUS_MONITOR_DELETE_POLICY_SENSOR] == NULL
+        || tb[ESP_UBUS_MONITOR_DELETE_POLICY_FIELD] == NULL) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+
+    enum EspMonitorResult monitor_result = delete_esp_monitor(
+        blobmsg_get_string(tb[ESP_UBUS_MONITOR_DELETE_POLICY_PORT]),
+        blobmsg_get_u32(tb[ESP_UBUS_MONITOR_DELETE_POLICY_PIN]),
+        blobmsg_get_string(tb[ESP_UBUS_MONITOR_DELETE_POLICY_SENSOR]),
+        blobmsg_get_string(tb[ESP_UBUS_MONITOR_DELETE_POLICY_FIELD])
+    );
+    send_esp_monitor_result_reply(ctx, req, monitor_result);
+
+    return UBUS_STATUS_OK;
+}
+
+static int
+device_toggle_pin(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct EspDevice *device = container_of(obj, struct EspDeviceObject, object)->device;
+
+    struct blob_attr *tb[__ESP_UBUS_DEVICE_TOGGLE_PIN_POLICY_MAX];
+    blobmsg_parse(
+        esp_device_toggle_pin_policy,
+        __ESP_UBUS_DEVICE_TOGGLE_PIN_POLICY_MAX,
+        tb,
+        blob_data(msg),
+        blob_len(msg)
+    );
+    if (tb[ESP_UBUS_DEVICE_TOGGLE_PIN_POLICY_PIN] == NULL) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+    int pin = blobmsg_get_u32(tb[ESP_UBUS_DEVICE_TOGGLE_PIN_POLICY_PIN]);
+
+    int pin_target_state = -1;
+    get_pin_target_state_from_ubus_method(&pin_target_state, (char*) method);
+    assert(pin_target_state != -1); // Ubus method, which called pin_toggle was not on or off.
+
+    struct EspAction esp_action = {
+        .action_type = pin_target_state == 1 ? ESP_ACTION_ON : ESP_ACTION_OFF,
+        .port_name = device->port_name,
+        .pin = pin,
+    };
+
+    return submit_esp_action(
+        ctx,
+        req,
+        device,
+        &esp_action,
+        tb[ESP_UBUS_DEVICE_TOGGLE_PIN_POLICY_TIMEOUT]
+    );
+}
+
+static int
+device_get_sensor(
+    struct ubus_context *ctx,
+    struct ubus_object *obj,
+    struct ubus_request_data *req,
+    const char *method,
+    struct blob_attr *msg
+) {
+    struct EspDevice *device = container_of(obj, struct EspDeviceObject, object)->device;
+
+    struct blob_attr *tb[__ESP_UBUS_DEVICE_GET_SENSOR_POLICY_MAX];
+    blobmsg_parse(
+        esp_device_get_sensor_policy,
+        __ESP_UBUS_DEVICE_GET_SENSOR_POLICY_MAX,
+        tb,
+        blob_data(msg),
+        blob_len(msg)
+    );
+    if (tb[ESP_UBUS_DEVICE_GET_SENSOR_POLICY_PIN] == NULL
+        || tb[ESP_UBUS_DEVICE_GET_SENSOR_POLICY_SENSOR] == NULL
+        || tb[ESP_UBUS_DEVICE_GET_SENSOR_POLICY_SENSOR_MODEL] == NULL) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+
+    struct EspAction esp_action = {
+        .action_type = ESP_ACTION_GET_SENSOR,
+        .port_name = device->port_name,
+        .pin = blobmsg_get_u32(tb[ESP_UBUS_DEVICE_GET_SENSOR_POLICY_PIN]),
+        .sensor = blobmsg_get_string(tb[ESP_UBUS_DEVICE_GET_SENSOR_POLICY_SENSOR]),
+        .model = blobmsg_get_string(tb[ESP_UBUS_DEVICE_GET_SENSOR_POLICY_SENSOR_MODEL]),
+    };
+
+    return submit_esp_action(
+        ctx,
+        req,
+        device,
+        &esp_action,
+        tb[ESP_UBUS_DEVICE_GET_SENSOR_POLICY_TIMEOUT]
+    );
+}
+
+static void
+format_esp_device_object_name(char *name, int name_size, const char *suffix) {
+    snprintf(name, name_size, "%s.%s", ESP_UBUS_OBJECT_NAME, suffix);
+    // Serial numbers and port names may contain anything, keep object names tame.
+    for (char *c = name + strlen(ESP_UBUS_OBJECT_NAME) + 1; *c != '\0'; c++) {
+        if (!isalnum((unsigned char) *c) && *c != '-' && *c != '_') {
+            *c = '_';
+        }
+    }
+}
+
+static bool
+add_esp_device_object(struct EspDeviceObject *device_object, const char *suffix) {
+    char name[256];
+    format_esp_device_object_name(name, sizeof(name), suffix);
+
+    device_object->name = strdup(name);
+    if (device_object->name == NULL) {
+        return false;
+    }
+    device_object->object = (struct ubus_object) {
+        .name = device_object->name,
+        .type = &esp_device_object_type,
+        .methods = esp_device_methods,
+        .n_methods = ARRAY_SIZE(esp_device_methods),
+    };
+    if (ubus_add_object(g_ubus_context, &device_object->object) != 0) {
+        syslog(LOG_WARNING, "Failed to add ubus object %s.", device_object->name);
+        free(device_object->name);
+        device_object->name = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static void
+remove_esp_device_object(struct EspDeviceObject *device_object) {
+    if (device_object->object.id == 0) {
+        return;
+    }
+    ubus_remove_object(g_ubus_context, &device_object->object);
+    device_object->object.id = 0;
+    free(device_object->name);
+    device_object->name = NULL;
+}
+
+static void
+esp_device_attached(struct EspDevice *device) {
+    const char *port_basename = strrchr(device->port_name, '/');
+    port_basename = port_basename != NULL ? port_basename + 1 : device->port_name;
+    add_esp_device_object(&device->object, port_basename);
+}
+
+// Port names follow plug order, the serial number stays with the ESP. Whether the
+// serial number is unique is only known once the whole scan is through.
+static void
+update_esp_device_alias(struct EspDevice *device, void *ctx) {
+    char alias[128];
+    if (device->port == NULL || !get_esp_device_alias(device, alias, sizeof(alias))) {
+        remove_esp_device_object(&device->alias_object);
+        return;
+    }
+
+    char name[256];
+    format_esp_device_object_name(name, sizeof(name), alias);
+    if (device->alias_object.object.id != 0 && strcmp(device->alias_object.name, name) == 0) {
+        return;
+    }
+    remove_esp_device_object(&device->alias_object);
+    add_esp_device_object(&device->alias_object, alias);
+}
+
+static void
+esp_device_detached(struct EspDevice *device) {
+    EspRequestQueue_free(&device->queue, USB_RESULT_ERR_PORT_NOT_FOUND);
+    remove_esp_device_object(&device->object);
+    remove_esp_device_object(&device->alias_object);
+}
+
+static void
+hotplug_scan_cb(struct uloop_timeout *timeout) {
+    sync_esp_devices(esp_device_attached, esp_device_detached);
+    for_each_esp_device(update_esp_device_alias, NULL);
+    uloop_timeout_set(timeout, ESP_HOTPLUG_SCAN_INTERVAL_MS);
+}
+
+static struct uloop_timeout
+hotplug_scan_timeout = {
+    .cb = hotplug_scan_cb,
+};
+
+enum UbusResult
+ubus_init(struct ubus_context **context) {
+    struct ubus_context *ctx = ubus_connect(NULL);
+    *context = ctx;
+    if (ctx == NULL) {
+        return UBUS_RESULT_ERROR_CONNECTION_FAILED;
+    }
+    uloop_init();
+    ubus_add_uloop(ctx);
+    if (ubus_add_object(ctx, &esp_object) != 0) {
+        return UBUS_RESULT_ERROR_INIT_FAILED;
+    }
+
+    g_ubus_context = ctx;
+    init_esp_monitors(ctx, &esp_object);
+    hotplug_scan_cb(&hotplug_scan_timeout);
 
     return UBUS_RESULT_OK;
 }
 
 void
 ubus_deinit(struct ubus_context *context) {
+    uloop_timeout_cancel(&hotplug_scan_timeout);
+    free_esp_monitors();
+    free_esp_devices(esp_device_detached);
+    free_esp_groups();
     ubus_free(context);
     uloop_done();
 }
@@ -0,0 +1,254 @@
+// Replays a trace dumped by espcommd against a simulated ESP behind a pty. The
+// simulator answers every recorded request with the recorded bytes and timing,
+// while the requests go through the daemon's serial code, so the replayed
+// latencies can be checked against the recorded ones.
+#include "serial.h"
+#include "codec.h"
+#include "trace.h"
+#include "clock.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define REPLAY_READ_BUFFER_SIZE 1024
+#define REPLAY_REQUEST_TIMEOUT_MS 5000
+#define REPLAY_DEFAULT_TOLERANCE_MS 50
+
+static int
+captured_len(int len) {
+    return len < ESP_TRACE_DATA_SIZE ? len : ESP_TRACE_DATA_SIZE;
+}
+
+static bool
+read_request(int fd, int len) {
+    char buf[ESP_TRACE_DATA_SIZE];
+    int received = 0;
+    while (received < len) {
+        struct pollfd pollfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pollfd, 1, REPLAY_REQUEST_TIMEOUT_MS) <= 0) {
+            return false;
+        }
+        ssize_t ret = read(fd, buf, len - received);
+        if (ret <= 0) {
+            return false;
+        }
+        received += ret;
+    }
+    return true;
+}
+
+static void
+sleep_us(uint64_t us) {
+    struct timespec duration = {.tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000};
+    nanosleep(&duration, NULL);
+}
+
+// The end of the request read from the pty stands in for the recorded write end.
+static void
+simulate_esp(int fd, const struct EspTraceRecord *records, int record_count) {
+    for (int i = 0; i < record_count; i++) {
+        const struct EspTraceRecord *record = &records[i];
+        if (!read_request(fd, captured_len(record->written_len))) {
+            fprintf(stderr, "Simulator: request %d did not arrive.\n", i);
+            return;
+        }
+        int read_len = captured_len(record->read_len);
+        if (read_len == 0) {
+            continue;
+        }
+
+        sleep_us(record->read_first_us - record->write_end_us);
+        if (write(fd, record->read, 1) != 1) {
+            return;
+        }
+        if (read_len > 1) {
+            sleep_us(record->read_last_us - record->read_first_us);
+            if (write(fd, record->read + 1, read_len - 1) != read_len - 1) {
+                return;
+            }
+        }
+    }
+}
+
+static int
+open_pty(char **slave_name) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (grantpt(fd) != 0 || unlockpt(fd) != 0 || (*slave_name = ptsname(fd)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static long
+latency_ms(uint64_t start_us, uint64_t end_us) {
+    return end_us != 0 ? (long) ((end_us - start_us) / 1000) : -1;
+}
+
+// Only transactions whose outcome was the ESP's own are compared. Ones which
+// never reached it, ones cut short by the daemon's deadline and ones still
+// without a response when the trace was dumped would end differently here.
+static bool
+is_replayable_record(const struct EspTraceRecord *record) {
+    switch (record->usb_result) {
+        case USB_RESULT_ERR_PORT_WRITE:
+        case USB_RESULT_ERR_DEADLINE:
+            return false;
+        case USB_RESULT_OK:
+            return record->read_len > 0;
+        default:
+            return true;
+    }
+}
+
+static void
+replay_transfer_done(struct SerialTransfer *transfer) {
+    uloop_end();
+}
+
+// Runs the request through uloop like the daemon does. Returns false if the
+// replayed latency is off by more than tolerance_ms.
+static bool
+replay_record(struct sp_port *port, int index, const struct EspTraceRecord *record, long tolerance_ms) {
+    char response_buf[REPLAY_READ_BUFFER_SIZE] = {0};
+    bool is_frame = esp_codec_is_frame((const char *) record->read, captured_len(record->read_len));
+    struct SerialTransfer transfer = {
+        .exchange = {
+            .port = port,
+            .input_buf = (const char *) record->written,
+            .write_bytes = captured_len(record->written_len),
+            .response_buf = response_buf,
+            .read_bytes = sizeof(response_buf) - 1,
+            .response_length = is_frame ? esp_codec_frame_length : NULL,
+        },
+        .done = replay_transfer_done,
+    };
+    enum UsbResult usb_result = start_serial_transfer(&transfer, monotonic_ms() + REPLAY_REQUEST_TIMEOUT_MS);
+    if (usb_result == USB_RESULT_OK) {
+        uloop_run();
+        usb_result = transfer.exchange.usb_result;
+    }
+    const struct EspTraceRecord *replayed = last_esp_trace_record();
+
+    long recorded_first = latency_ms(record->write_start_us, record->read_first_us);
+    long recorded_last = latency_ms(record->write_start_us, record->read_last_us);
+    long replayed_first = latency_ms(replayed->write_start_us, replayed->read_first_us);
+    long replayed_last = latency_ms(replayed->write_start_us, replayed->read_last_us);
+    bool within_tolerance = usb_result == record->usb_result
+        && labs(replayed_first - recorded_first) <= tolerance_ms
+        && labs(replayed_last - recorded_last) <= tolerance_ms;
+
+    printf(
+        "%4d %-16s first %5ld/%5ld ms last %5ld/%5ld ms %s\n",
+        index,
+        record->port_name,
+        recorded_first,
+        replayed_first,
+        recorded_last,
+        replayed_last,
+        within_tolerance ? "ok" : "REGRESSION"
+    );
+
+    return within_tolerance;
+}
+
+int main(int argc, char **argv) {
+    const char *port_filter = NULL;
+    long tolerance_ms = REPLAY_DEFAULT_TOLERANCE_MS;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:t:")) != -1) {
+        switch (opt) {
+            case 'p':
+                port_filter = optarg;
+                break;
+            case 't':
+                tolerance_ms = strtol(optarg, NULL, 10);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+        goto usage;
+    }
+
+    struct EspTraceRecord *records;
+    int record_count;
+    enum EspTraceResult trace_result = load_esp_trace(argv[optind], &records, &record_count);
+    if (trace_result != ESP_TRACE_RESULT_OK) {
+        fprintf(stderr, "%s\n", EspTraceResult_str[trace_result]);
+        return 1;
+    }
+
+    // Transactions of other ports are dropped, the rest keep their order.
+    int replay_count = 0;
+    int skipped_count = 0;
+    for (int i = 0; i < record_count; i++) {
+        if (port_filter != NULL && strcmp(records[i].port_name, port_filter) != 0) {
+            continue;
+        }
+        if (!is_replayable_record(&records[i])) {
+            skipped_count++;
+            continue;
+        }
+        records[replay_count++] = records[i];
+    }
+    if (skipped_count > 0) {
+        printf("Skipping %d transactions which did not end on the ESP's account.\n", skipped_count);
+    }
+
+    char *slave_name;
+    int master_fd = open_pty(&slave_name);
+    if (master_fd < 0) {
+        fprintf(stderr, "Failed to open pty.\n");
+        free(records);
+        return 1;
+    }
+
+    pid_t simulator = fork();
+    if (simulator == 0) {
+        simulate_esp(master_fd, records, replay_count);
+        _exit(0);
+    }
+
+    int exit_code = 0;
+    struct sp_port *port = NULL;
+    uloop_init();
+    if (sp_get_port_by_name(slave_name, &port) != SP_OK || open_port(port) != USB_RESULT_OK) {
+        fprintf(stderr, "Failed to open %s.\n", slave_name);
+        exit_code = 1;
+        goto cleanup;
+    }
+
+    printf("   # port             first recorded/replayed last recorded/replayed\n");
+    for (int i = 0; i < replay_count; i++) {
+        if (!replay_record(port, i, &records[i], tolerance_ms)) {
+            exit_code = 1;
+        }
+    }
+    sp_close(port);
+
+cleanup:
+    if (port != NULL) {
+        sp_free_port(port);
+    }
+    uloop_done();
+    kill(simulator, SIGTERM);
+    waitpid(simulator, NULL, 0);
+    close(master_fd);
+    free(records);
+
+    return exit_code;
+
+usage:
+    fprintf(stderr, "Usage: %s [-p port] [-t tolerance_ms] <trace>\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,176 @@
+// The libserialport calls the daemon's serial code makes, on top of a pty. The
+// replay tool links this instead of libserialport, which cannot open ptys:
+// sp_get_port_by_name looks the port up in sysfs, where /dev/pts has no entries,
+// and sp_open fails on the TIOCMGET ptys do not support. Enumeration and modem
+// control lines are reported as unsupported.
+#include <libserialport.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+struct sp_port {
+    char *name;
+    int fd;
+};
+
+enum sp_return
+sp_get_port_by_name(const char *portname, struct sp_port **port_ptr) {
+    struct sp_port *port = calloc(1, sizeof(struct sp_port));
+    if (port == NULL || (port->name = strdup(portname)) == NULL) {
+        free(port);
+        return SP_ERR_MEM;
+    }
+    port->fd = -1;
+    *port_ptr = port;
+    return SP_OK;
+}
+
+enum sp_return
+sp_copy_port(const struct sp_port *port, struct sp_port **copy_ptr) {
+    return sp_get_port_by_name(port->name, copy_ptr);
+}
+
+void
+sp_free_port(struct sp_port *port) {
+    free(port->name);
+    free(port);
+}
+
+enum sp_return
+sp_list_ports(struct sp_port ***list_ptr) {
+    *list_ptr = calloc(1, sizeof(struct sp_port *));
+    return *list_ptr != NULL ? SP_OK : SP_ERR_MEM;
+}
+
+void
+sp_free_port_list(struct sp_port **list) {
+    for (int i = 0; list[i] != NULL; i++) {
+        sp_free_port(list[i]);
+    }
+    free(list);
+}
+
+char *
+sp_get_port_name(const struct sp_port *port) {
+    return port->name;
+}
+
+enum sp_transport
+sp_get_port_transport(const struct sp_port *port) {
+    return SP_TRANSPORT_NATIVE;
+}
+
+enum sp_return
+sp_get_port_usb_vid_pid(const struct sp_port *port, int *usb_vid, int *usb_pid) {
+    return SP_ERR_SUPP;
+}
+
+enum sp_return
+sp_get_port_handle(const struct sp_port *port, void *result_ptr) {
+    if (port->fd < 0) {
+        return SP_ERR_ARG;
+    }
+    *(int *) result_ptr = port->fd;
+    return SP_OK;
+}
+
+enum sp_return
+sp_open(struct sp_port *port, enum sp_mode flags) {
+    port->fd = open(port->name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (port->fd < 0) {
+        return SP_ERR_FAIL;
+    }
+
+    struct termios termios;
+    if (tcgetattr(port->fd, &termios) != 0) {
+        goto fail;
+    }
+    cfmakeraw(&termios);
+    termios.c_cflag |= CLOCAL | CREAD;
+    if (tcsetattr(port->fd, TCSANOW, &termios) != 0) {
+        goto fail;
+    }
+    return SP_OK;
+
+fail:
+    close(port->fd);
+    port->fd = -1;
+    return SP_ERR_FAIL;
+}
+
+enum sp_return
+sp_close(struct sp_port *port) {
+    if (port->fd < 0) {
+        return SP_ERR_ARG;
+    }
+    close(port->fd);
+    port->fd = -1;
+    return SP_OK;
+}
+
+// A pty has no line settings worth keeping, the configuration is accepted as is.
+enum sp_return
+sp_new_config(struct sp_port_config **config_ptr) {
+    *config_ptr = NULL;
+    return SP_OK;
+}
+
+void
+sp_free_config(struct sp_port_config *config) {
+}
+
+enum sp_return
+sp_set_config(struct sp_port *port, const struct sp_port_config *config) {
+    return SP_OK;
+}
+
+enum sp_return
+sp_set_config_baudrate(struct sp_port_config *config, int baudrate) {
+    return SP_OK;
+}
+
+enum sp_return
+sp_set_config_bits(struct sp_port_config *config, int bits) {
+    return SP_OK;
+}
+
+enum sp_return
+sp_set_config_parity(struct sp_port_config *config, enum sp_parity parity) {
+    return SP_OK;
+}
+
+enum sp_return
+sp_set_config_flowcontrol(struct sp_port_config *config, enum sp_flowcontrol flowcontrol) {
+    return SP_OK;
+}
+
+enum sp_return
+sp_set_dtr(struct sp_port *port, enum sp_dtr dtr) {
+    return SP_ERR_SUPP;
+}
+
+enum sp_return
+sp_set_rts(struct sp_port *port, enum sp_rts rts) {
+    return SP_ERR_SUPP;
+}
+
+enum sp_return
+sp_nonblocking_read(struct sp_port *port, void *buf, size_t count) {
+    ssize_t ret = read(port->fd, buf, count);
+    if (ret < 0) {
+        return errno == EAGAIN ? 0 : SP_ERR_FAIL;
+    }
+    return ret;
+}
+
+enum sp_return
+sp_nonblocking_write(struct sp_port *port, const void *buf, size_t count) {
+    ssize_t ret = write(port->fd, buf, count);
+    if (ret < 0) {
+        return errno == EAGAIN ? 0 : SP_ERR_FAIL;
+    }
+    return ret;
+}